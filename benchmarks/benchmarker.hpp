@@ -13,10 +13,10 @@ namespace benchmarker {
 static std::map<std::string, std::function<void()>> map;
 
 static void run() {
-	double minDuration = 100000000;
-	double maxDuration = -1;
-	double avgDuration = 0;
 	for (const auto & pair : map) {
+		double minDuration = 100000000;
+		double maxDuration = -1;
+		double avgDuration = 0;
 		for (int i=0; i<1000; i++) {
 			struct timespec begin, end;
 
@@ -5,11 +5,65 @@
 namespace {
 
 int dataInt[1000];
+std::vector<int> numbers;
+
+struct User {
+	int id;
+	std::string name;
+	std::string email;
+	double score;
+	bool active;
+};
+
+std::vector<User> users;
 
 __attribute__((constructor)) static void init() {
 	for (auto & x : dataInt) {
 		x = rand();
 	}
+	for (int i = 0; i < 100000; i++) {
+		numbers.push_back(rand() - RAND_MAX / 2);
+	}
+	for (int i = 0; i < 1000; i++) {
+		users.push_back(User{ rand(), "User \"" + std::to_string(i) + "\" with a reasonably long display name", "user" + std::to_string(i) + "@example.com", rand() / 1000.0, (i % 3) != 0 });
+	}
+}
+
+// What a typical hand-written serializer looks like: per-byte escaping, std::to_string for numbers
+void appendJsonString(std::string & out, const std::string & s) {
+	out += '"';
+	for (char c : s) {
+		switch (c) {
+			case '"':  out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\n': out += "\\n"; break;
+			default:
+				if ((unsigned char)c < 0x20) { char buf[8]; snprintf(buf, sizeof(buf), "\\u%04x", c); out += buf; } else { out += c; }
+		}
+	}
+	out += '"';
+}
+
+std::string serializeUsers(const std::vector<User> & users) {
+	std::string out = "[";
+	bool first = true;
+	for (const auto & user : users) {
+		if (!first) out += ',';
+		first = false;
+		out += "\n{\"id\": " + std::to_string(user.id) + ", \"name\": ";
+		appendJsonString(out, user.name);
+		out += ", \"email\": ";
+		appendJsonString(out, user.email);
+		char score[32];
+		snprintf(score, sizeof(score), "%.17g", user.score);
+		out += ", \"score\": ";
+		out += score;
+		out += ", \"active\": ";
+		out += user.active ? "true" : "false";
+		out += '}';
+	}
+	out += "\n]\n";
+	return out;
 }
 
 }
@@ -22,6 +76,33 @@ int main() {
 		assert(res.back() == '\n');
 	};
 
+	BENCHMARK("1000 users to JSON, template") {
+		std::string res = TEMPLATE(users);
+		assert(res.back() == '\n');
+	};
+
+	BENCHMARK("1000 users to JSON, hand-written") {
+		std::string res = serializeUsers(users);
+		assert(res.back() == '\n');
+	};
+
+	BENCHMARK("100k-row numeric table") {
+		std::string res = TEMPLATE(numbers);
+		assert(res.back() == '\n');
+	};
+
+	BENCHMARK("1000 e-mails, TEMPLATE() each") {
+		std::vector<std::string> emails;
+		emails.reserve(users.size());
+		for (const auto & user : users) emails.push_back(TEMPLATE(email));
+		assert(emails.back().back() == '\n');
+	};
+
+	BENCHMARK("1000 e-mails, TEMPLATE_BATCH()") {
+		serenity::templater::Batch emails = TEMPLATE_BATCH(email, user, users);
+		assert(emails.data.back() == '\n');
+	};
+
 	serenity::benchmarker::run();
 }
 
@@ -1,7 +1,1741 @@
 #pragma once
 
 #include <sstream>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include <tuple>
+#include <string>
+#include <algorithm>
+#include <ostream>
+#include <streambuf>
+#include <cstring>
+#include <fstream>
+#include <cmath>
+#include <cstdio>
+#include <type_traits>
+#include <cstddef>
+#include <new>
+#include <future>
+#include <memory>
+#include <iterator>
+#include <locale>
+#include <array>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/uio.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define __SERENITY_TEMPLATER_HPP__INCLUDED__
 
-#define TEMPLATE(NAME) __SERENITY_TEMPLATER_TEMPLATE_ ## NAME ()
+// Renders template NAME into a new std::string
+#define TEMPLATE(NAME) ([&](){ \
+	serenity::templater::StringStream __serenity_templater_res(__serenity_templater_output_size_ ## NAME ()); \
+	__SERENITY_TEMPLATER_TEMPLATE_ ## NAME \
+	return __serenity_templater_res.str(); }())
+
+// Output of template NAME as serenity::templater::StaticView, for templates made of static text and literals only.
+// The output is a static array, nothing is rendered; other templates don't compile
+#define TEMPLATE_VIEW(NAME) (__serenity_templater_static_ ## NAME ())
+
+// Appends template NAME to OUT, a std::string or std::vector<char>, returns the number of bytes appended.
+// Reusing OUT (clear() keeps the capacity) makes steady-state renders allocation-free
+#define TEMPLATE_INTO(NAME, OUT) ([&](){ \
+	serenity::templater::AppendStreamFor<decltype(OUT)> __serenity_templater_res((OUT), __serenity_templater_output_size_ ## NAME ()); \
+	__SERENITY_TEMPLATER_TEMPLATE_ ## NAME \
+	return __serenity_templater_res.finish(); }())
+
+// Renders template NAME once per element of RANGE, with the element as variable ITEM, back to back into one buffer.
+// Returns serenity::templater::Batch, the output and where each instance is in it
+#define TEMPLATE_BATCH(NAME, ITEM, RANGE) ([&](){ \
+	auto && __serenity_templater_range = (RANGE); \
+	serenity::templater::BatchStream __serenity_templater_res(__serenity_templater_output_size_ ## NAME (), \
+		(std::size_t)std::distance(std::begin(__serenity_templater_range), std::end(__serenity_templater_range))); \
+	for (auto && ITEM : __serenity_templater_range) { \
+		__SERENITY_TEMPLATER_TEMPLATE_ ## NAME \
+		__serenity_templater_res.next(); \
+	} \
+	return __serenity_templater_res.batch(); }())
+
+// Renders template NAME into a serenity::templater::ArenaString allocated from ARENA (serenity::templater::Arena)
+#define TEMPLATE_IN_ARENA(NAME, ARENA) ([&](){ \
+	serenity::templater::ArenaString __serenity_templater_out{serenity::templater::ArenaAllocator<char>(ARENA)}; \
+	TEMPLATE_INTO(NAME, __serenity_templater_out); \
+	return __serenity_templater_out; }())
+
+// Renders template NAME into a serenity::templater::Rope: blocks that are never copied once written,
+// with long static text pointed to instead of copied
+#define TEMPLATE_ROPE(NAME) ([&](){ \
+	serenity::templater::RopeStream __serenity_templater_res; \
+	__SERENITY_TEMPLATER_TEMPLATE_ ## NAME \
+	return __serenity_templater_res.rope(); }())
+
+// Renders template NAME in pieces to SINK, a variable callable as SINK(const char * data, std::size_t size):
+// on $flush, before the first command when the template starts with static text, whenever the buffer fills up and at the end.
+// Returns the number of bytes rendered
+#define TEMPLATE_STREAM(NAME, SINK) ([&](){ \
+	serenity::templater::SinkStreamFor<decltype(SINK)> __serenity_templater_res(SINK); \
+	__SERENITY_TEMPLATER_TEMPLATE_ ## NAME \
+	return __serenity_templater_res.finish(); }())
+
+// Renders template NAME into SIZE bytes at BUFFER (char *) without allocating,
+// returns serenity::templater::RenderResult
+#define TEMPLATE_TO_BUFFER(NAME, BUFFER, SIZE) ([&](){ \
+	serenity::templater::FixedStream __serenity_templater_res((BUFFER), (SIZE)); \
+	__SERENITY_TEMPLATER_TEMPLATE_ ## NAME \
+	return __serenity_templater_res.result(); }())
+
+
+namespace serenity {
+namespace templater {
+
+// Intrusive lock-free list of every object of type T ever constructed, for function-local statics in generated code
+template<class T>
+class Registered {
+public:
+	T * next;
+
+	static T * first() { return head().load(std::memory_order_acquire); }
+
+protected:
+	Registered() : next(nullptr) {
+		std::atomic<T*> & h = head();
+		next = h.load(std::memory_order_relaxed);
+		while (!h.compare_exchange_weak(next, static_cast<T*>(this), std::memory_order_release, std::memory_order_relaxed)) {}
+	}
+	Registered(const Registered &) = delete;
+	Registered & operator=(const Registered &) = delete;
+
+private:
+	static std::atomic<T*> & head() {
+		static std::atomic<T*> h(nullptr);
+		return h;
+	}
+};
+
+// Recent output size of one template, used to reserve the whole output buffer up front.
+// Decaying maximum: follows growth immediately and shrinks by 1/256 per smaller render,
+// so steady-state renders never reallocate
+class OutputSize : public Registered<OutputSize> {
+	std::atomic<std::size_t> value;
+public:
+	const char * templateName;
+
+	// minimum: bytes every render writes, known to htmltpp, so that the first render reserves them too
+	explicit OutputSize(const char * templateName, std::size_t minimum = 0) : value(minimum), templateName(templateName) {}
+
+	std::size_t estimate() const { return value.load(std::memory_order_relaxed); }
+
+	// Racing updates may lose one sample, which is fine for an estimate
+	void update(std::size_t size) {
+		std::size_t old = value.load(std::memory_order_relaxed);
+		std::size_t decayed = old - old / 256;
+		value.store(std::max(size, decayed), std::memory_order_relaxed);
+	}
+};
+
+// Current output size estimates of all templates rendered at least once, by template name
+inline std::map<std::string, std::size_t> outputSizeEstimates() {
+	std::map<std::string, std::size_t> res;
+	for (OutputSize * size = OutputSize::first(); size; size = size->next) {
+		res[size->templateName] = size->estimate();
+	}
+	return res;
+}
+
+
+// What TEMPLATE_VIEW() returns: the output of a template without dynamic parts, valid for the program's lifetime
+struct StaticView {
+	const char * data;
+	std::size_t size;
+
+	std::string str() const { return std::string(data, size); }
+};
+
+
+// Appends to a std::string or std::vector<char>, writing straight into it.
+// The container holds zeros past the written bytes, at most a window's worth, until finish()
+template<class Container>
+class AppendBuf : public std::streambuf {
+	// resize() zero-fills what it adds, so the container's size only runs this far ahead of the writes
+	static const std::size_t WINDOW = 4096;
+
+	Container & container;
+	bool finished;
+
+	char * data() { return container.empty() ? nullptr : &container[0]; }
+
+	// Makes n more bytes writable: the capacity grows geometrically, the size only to the next window
+	void extend(std::size_t n) {
+		reserve(n);
+		std::size_t used = size();
+		container.resize(std::min(container.capacity(), used + std::max(n, WINDOW)));
+		setp(data() + used, data() + container.size());
+	}
+
+	void advance(std::size_t n) { setp(pptr() + n, epptr()); }
+
+public:
+	explicit AppendBuf(Container & container, std::size_t reserve = 0) : container(container), finished(false) {
+		std::size_t used = container.size();
+		container.reserve(used + reserve);
+		setp(data() + used, data() + used);
+	}
+	~AppendBuf() { finish(); }
+
+	std::size_t size() const { return pptr() ? (std::size_t)(pptr() - &container[0]) : container.size(); }
+
+	// Makes room for n more bytes, growing geometrically so that repeated small reservations stay cheap
+	void reserve(std::size_t n) {
+		std::size_t used = size();
+		if (container.capacity() - used >= n) return;
+		std::size_t end = container.size();
+		container.reserve(std::max(2 * container.capacity(), used + n));
+		setp(data() + used, data() + end);
+	}
+
+	// Cuts the container down to the written bytes; no writes are allowed afterwards
+	void finish() {
+		if (finished) return;
+		container.resize(size());
+		setp(nullptr, nullptr);
+		finished = true;
+	}
+
+	AppendBuf(const AppendBuf &) = delete;
+	AppendBuf & operator=(const AppendBuf &) = delete;
+
+protected:
+	int_type overflow(int_type c) override {
+		if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+		if (pptr() == epptr()) extend(1);
+		*pptr() = traits_type::to_char_type(c);
+		advance(1);
+		return c;
+	}
+
+	std::streamsize xsputn(const char * s, std::streamsize n) override {
+		if (epptr() - pptr() < n) extend((std::size_t)n);
+		std::memcpy(pptr(), s, (std::size_t)n);
+		advance((std::size_t)n);
+		return n;
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir way, std::ios_base::openmode which) override {
+		if ((off != 0) || (way != std::ios_base::cur) || !(which & std::ios_base::out)) return pos_type(off_type(-1));
+		return pos_type((off_type)size());
+	}
+};
+
+template<class Container> const std::size_t AppendBuf<Container>::WINDOW;
+
+// What TEMPLATE_INTO() renders into: appends to a container, reserving the template's recent output size
+template<class Container>
+class AppendStream : public std::ostream {
+	AppendBuf<Container> buf;
+	OutputSize & outputSize;
+	std::size_t begin;
+public:
+	AppendStream(Container & container, OutputSize & outputSize)
+		: std::ostream(nullptr), buf(container, outputSize.estimate()), outputSize(outputSize), begin(buf.size()) {
+		rdbuf(&buf);
+	}
+
+	void reserve(std::size_t n) { buf.reserve(n); }
+
+	// Returns the number of bytes appended
+	std::size_t finish() {
+		std::size_t size = buf.size() - begin;
+		buf.finish();
+		outputSize.update(size);
+		return size;
+	}
+};
+
+template<class Container> using AppendStreamFor = AppendStream<typename std::remove_reference<Container>::type>;
+
+struct StringHolder { std::string string; };
+
+// What TEMPLATE() renders into: a std::string reserved at the template's recent output size
+class StringStream : private StringHolder, public AppendStream<std::string> {
+public:
+	explicit StringStream(OutputSize & outputSize) : StringHolder(), AppendStream<std::string>(string, outputSize) {}
+
+	std::string str() {
+		finish();
+		return std::move(string);
+	}
+};
+
+
+// Output of TEMPLATE_BATCH(): all instances in one string
+struct Batch {
+	struct Span {
+		std::size_t offset;
+		std::size_t size;
+	};
+
+	std::string data;
+	std::vector<Span> spans;  // one per instance, in range order
+
+	std::size_t size() const { return spans.size(); }
+	std::string str(std::size_t i) const { return data.substr(spans[i].offset, spans[i].size); }
+};
+
+struct BatchHolder { Batch value; };
+
+// What TEMPLATE_BATCH() renders into: one stream and one buffer, reserved for all instances up front
+class BatchStream : private BatchHolder, public std::ostream {
+	AppendBuf<std::string> buf;
+	OutputSize & outputSize;
+	std::size_t begin;
+public:
+	BatchStream(OutputSize & outputSize, std::size_t count)
+		: BatchHolder(), std::ostream(nullptr), buf(value.data, outputSize.estimate() * count), outputSize(outputSize), begin(0) {
+		rdbuf(&buf);
+		value.spans.reserve(count);
+	}
+
+	void reserve(std::size_t n) { buf.reserve(n); }
+
+	// Ends the current instance
+	void next() {
+		std::size_t size = buf.size() - begin;
+		value.spans.push_back(Batch::Span{begin, size});
+		outputSize.update(size);
+		begin += size;
+	}
+
+	Batch batch() {
+		buf.finish();
+		return std::move(value);
+	}
+};
+
+
+// Output as a list of chunks, either in refcounted fixed-size blocks or borrowed from the templates' static text.
+// Appending never moves earlier bytes, and copies of a rope share its blocks
+class Rope {
+public:
+	struct Chunk {
+		const char * data;
+		std::size_t size;
+	};
+
+	static const std::size_t blockSize = 4096;
+	// Shorter static text is copied, one chunk per few bytes would cost more than the copy
+	static const std::size_t borrowThreshold = 64;
+
+	Rope() : total(0) {}
+
+	const std::vector<Chunk> & chunks() const { return chunkList; }
+	std::size_t size() const { return total; }
+
+	// Copies the chunks into contiguous memory
+	std::string flatten() const {
+		std::string res;
+		res.reserve(total);
+		for (const Chunk & chunk : chunkList) res.append(chunk.data, chunk.size);
+		return res;
+	}
+
+#if defined(__unix__) || defined(__APPLE__)
+	// For writev()/sendmsg(); points into the rope, which must outlive the result
+	std::vector<iovec> iovecs() const {
+		std::vector<iovec> res(chunkList.size());
+		for (std::size_t i = 0; i < chunkList.size(); i++) {
+			res[i].iov_base = const_cast<char *>(chunkList[i].data);
+			res[i].iov_len = chunkList[i].size;
+		}
+		return res;
+	}
+#endif
+
+private:
+	friend class RopeBuf;
+
+	class Block {
+		struct Header { std::atomic<std::size_t> refs; };
+		Header * header;
+		explicit Block(Header * header) : header(header) {}
+	public:
+		static Block allocate() {
+			Header * header = new (::operator new(sizeof(Header) + blockSize)) Header();
+			header->refs.store(1, std::memory_order_relaxed);
+			return Block(header);
+		}
+		Block(const Block & other) : header(other.header) { header->refs.fetch_add(1, std::memory_order_relaxed); }
+		Block(Block && other) noexcept : header(other.header) { other.header = nullptr; }
+		Block & operator=(const Block & other) {
+			Block copy(other);
+			std::swap(header, copy.header);
+			return *this;
+		}
+		Block & operator=(Block && other) noexcept {
+			std::swap(header, other.header);
+			return *this;
+		}
+		~Block() {
+			if (header && (header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)) {
+				header->~Header();
+				::operator delete(header);
+			}
+		}
+		char * data() const { return reinterpret_cast<char *>(header + 1); }
+	};
+
+	// Otherwise std::vector copies blocks when it grows, touching every refcount
+	static_assert(std::is_nothrow_move_constructible<Block>::value, "");
+
+	std::vector<Chunk> chunkList;
+	std::vector<Block> blocks;
+	std::size_t total;
+};
+
+// Writes into the last block of a rope, closing the current chunk whenever a block fills up or static text is borrowed
+class RopeBuf : public std::streambuf {
+	Rope & rope;
+	char * chunkBegin;
+
+	void closeChunk() {
+		std::size_t size = (std::size_t)(pptr() - chunkBegin);
+		if (!size) return;
+		rope.chunkList.push_back(Rope::Chunk{chunkBegin, size});
+		rope.total += size;
+		chunkBegin = pptr();
+	}
+
+	void newBlock() {
+		closeChunk();
+		rope.blocks.push_back(Rope::Block::allocate());
+		chunkBegin = rope.blocks.back().data();
+		setp(chunkBegin, chunkBegin + Rope::blockSize);
+	}
+
+public:
+	explicit RopeBuf(Rope & rope) : rope(rope), chunkBegin(nullptr) { setp(nullptr, nullptr); }
+
+	void borrow(const char * data, std::size_t size) {
+		closeChunk();
+		rope.chunkList.push_back(Rope::Chunk{data, size});
+		rope.total += size;
+	}
+
+	void finish() {
+		closeChunk();
+		setp(nullptr, nullptr);
+		chunkBegin = nullptr;
+	}
+
+	RopeBuf(const RopeBuf &) = delete;
+	RopeBuf & operator=(const RopeBuf &) = delete;
+
+protected:
+	int_type overflow(int_type c) override {
+		if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+		newBlock();
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+		return c;
+	}
+
+	std::streamsize xsputn(const char * s, std::streamsize n) override {
+		std::size_t left = (std::size_t)n;
+		while (left) {
+			if (pptr() == epptr()) newBlock();
+			std::size_t fits = std::min(left, (std::size_t)(epptr() - pptr()));
+			std::memcpy(pptr(), s, fits);
+			pbump((int)fits);
+			s += fits;
+			left -= fits;
+		}
+		return n;
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir way, std::ios_base::openmode which) override {
+		if ((off != 0) || (way != std::ios_base::cur) || !(which & std::ios_base::out)) return pos_type(off_type(-1));
+		return pos_type((off_type)(rope.total + (std::size_t)(pptr() - chunkBegin)));
+	}
+};
+
+struct RopeHolder { Rope value; };
+
+// What TEMPLATE_ROPE() renders into
+class RopeStream : private RopeHolder, public std::ostream {
+	RopeBuf buf;
+public:
+	RopeStream() : RopeHolder(), std::ostream(nullptr), buf(value) { rdbuf(&buf); }
+
+	void borrow(const char * data, std::size_t size) { buf.borrow(data, size); }
+
+	Rope rope() {
+		buf.finish();
+		return std::move(value);
+	}
+};
+
+// Static text of generated code. Only a rope keeps pointers to it, everything else copies
+inline void writeStatic(std::ostream & out, const char * data, std::size_t size) { out.write(data, (std::streamsize)size); }
+
+inline void writeStatic(RopeStream & out, const char * data, std::size_t size) {
+	if (size >= Rope::borrowThreshold) out.borrow(data, size); else out.write(data, (std::streamsize)size);
+}
+
+
+// Buffers output for a sink and hands it over on sync(), when the buffer is full and for writes too large to buffer
+template<class Sink>
+class SinkBuf : public std::streambuf {
+public:
+	static const std::size_t bufferSize = 4096;
+
+	explicit SinkBuf(Sink & sink) : sink(sink), sent(0) { setp(buffer, buffer + bufferSize); }
+
+	std::size_t size() const { return sent + (std::size_t)(pptr() - pbase()); }
+
+	SinkBuf(const SinkBuf &) = delete;
+	SinkBuf & operator=(const SinkBuf &) = delete;
+
+protected:
+	int sync() override {
+		std::size_t size = (std::size_t)(pptr() - pbase());
+		if (size) {
+			sink(static_cast<const char *>(pbase()), size);
+			sent += size;
+			setp(buffer, buffer + bufferSize);
+		}
+		return 0;
+	}
+
+	int_type overflow(int_type c) override {
+		if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+		sync();
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+		return c;
+	}
+
+	std::streamsize xsputn(const char * s, std::streamsize n) override {
+		if ((std::size_t)(epptr() - pptr()) < (std::size_t)n) sync();
+		if ((std::size_t)n >= bufferSize) {
+			sink(s, (std::size_t)n);
+			sent += (std::size_t)n;
+		} else {
+			std::memcpy(pptr(), s, (std::size_t)n);
+			pbump((int)n);
+		}
+		return n;
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir way, std::ios_base::openmode which) override {
+		if ((off != 0) || (way != std::ios_base::cur) || !(which & std::ios_base::out)) return pos_type(off_type(-1));
+		return pos_type((off_type)size());
+	}
+
+private:
+	Sink & sink;
+	std::size_t sent;
+	char buffer[bufferSize];
+};
+
+// What TEMPLATE_STREAM() renders into
+template<class Sink>
+class SinkStream : public std::ostream {
+	SinkBuf<Sink> buf;
+public:
+	explicit SinkStream(Sink & sink) : std::ostream(nullptr), buf(sink) { rdbuf(&buf); }
+
+	// Sends the rest, returns the number of bytes rendered
+	std::size_t finish() {
+		flush();
+		return buf.size();
+	}
+};
+
+template<class Sink> using SinkStreamFor = SinkStream<typename std::remove_reference<Sink>::type>;
+
+// One step of a template rendered by the table backend: static text of the string pool, or the next thunk when size is 0
+struct Op {
+	std::uint32_t offset;
+	std::uint32_t size;
+};
+
+// Runs the ops of the table backend, calling thunks(0), thunks(1)... for the ops that aren't static text
+template<class Stream, class Thunks>
+void run(Stream & out, const char * pool, const Op * ops, std::size_t count, Thunks & thunks) {
+	unsigned thunk = 0;
+	for (const Op * op = ops; op != ops + count; op++) {
+		if (op->size != 0) writeStatic(out, pool + op->offset, op->size); else thunks(thunk++);
+	}
+}
+
+// Before the first command of a template that starts with static text; only a streaming sink flushes there
+inline void flushPrefix(std::ostream &) {}
+
+template<class Sink> void flushPrefix(SinkStream<Sink> & out) { out.flush(); }
+
+// Number of elements of a $foreach range when it's known without walking it, 0 otherwise
+template<class Range> auto rangeSize(const Range & range, int) -> decltype((std::size_t)range.size()) { return (std::size_t)range.size(); }
+template<class Range> std::size_t rangeSize(const Range &, long) { return 0; }
+template<class T, std::size_t N> std::size_t rangeSize(const T (&)[N], int) { return N; }
+template<class Range> std::size_t rangeSize(const Range & range) { return rangeSize(range, 0); }
+
+// Before a $foreach: room for the loop's static text and the static text after it, in streams that grow
+inline void reserve(std::ostream &, std::size_t) {}
+
+template<class Container> void reserve(AppendStream<Container> & out, std::size_t size) { out.reserve(size); }
+
+inline void reserve(BatchStream & out, std::size_t size) { out.reserve(size); }
+
+
+// $await sections of one render, in template order. While a section's future is pending, the output after it
+// goes to a buffer of its own; sections are written out as soon as everything before them is
+class AwaitQueue {
+	struct Section {
+		std::string after;  // output between this section and the next one
+		AppendBuf<std::string> buf;
+
+		Section() : buf(after) {}
+		virtual ~Section() {}
+		virtual bool ready() = 0;
+		virtual void render(std::ostream & out) = 0;
+	};
+
+	// Future is a reference for lvalue futures, which stay with the caller
+	template<class Future, class Body>
+	struct FutureSection : Section {
+		Future future;
+		Body body;
+
+		FutureSection(Future && future, Body && body) : future(std::forward<Future>(future)), body(std::move(body)) {}
+		bool ready() override { return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+		void render(std::ostream & out) override { body(out, future.get()); }
+	};
+
+	// What the template writes to while sections are pending: the buffer of the last one. Every pumpInterval bytes
+	// and on $flush the sections that are ready by then are written out, and $flush flushes the output
+	class TailBuf : public std::streambuf {
+		static const std::size_t pumpInterval = 16384;
+		AwaitQueue & queue;
+		std::size_t written;  // since the last pump
+
+		void wrote(std::size_t n) {
+			written += n;
+			if (written < pumpInterval) return;
+			written = 0;
+			queue.pump(false);
+		}
+
+	public:
+		std::streambuf * target;
+
+		explicit TailBuf(AwaitQueue & queue) : queue(queue), written(0), target(nullptr) {}
+
+	protected:
+		int_type overflow(int_type c) override {
+			if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+			int_type res = target->sputc(traits_type::to_char_type(c));
+			wrote(1);
+			return res;
+		}
+
+		std::streamsize xsputn(const char * s, std::streamsize n) override {
+			std::streamsize res = target->sputn(s, n);
+			wrote((std::size_t)n);
+			return res;
+		}
+
+		int sync() override {
+			queue.pump(false);
+			return queue.out.rdbuf()->pubsync();
+		}
+	};
+
+	std::ostream & out;
+	TailBuf tailBuf;
+	std::ostream tailStream;  // what the template writes to after the first section
+	std::vector<std::unique_ptr<Section>> sections;
+
+	void pump(bool wait) {
+		if (sections.empty() || !(wait || sections.front()->ready())) return;
+		while (!sections.empty() && (wait || sections.front()->ready())) {
+			Section & section = *sections.front();
+			section.render(out);
+			section.buf.finish();
+			out.write(section.after.data(), (std::streamsize)section.after.size());
+			// Everything so far is out, the rest of the template can write directly
+			if (sections.size() == 1) tailStream.rdbuf(out.rdbuf());
+			sections.erase(sections.begin());
+		}
+		out.flush();
+	}
+
+public:
+	explicit AwaitQueue(std::ostream & out) : out(out), tailBuf(*this), tailStream(out.rdbuf()) {}
+
+	AwaitQueue(const AwaitQueue &) = delete;
+	AwaitQueue & operator=(const AwaitQueue &) = delete;
+
+	std::ostream & tail() { return tailStream; }
+
+	template<class Future, class Body>
+	void defer(Future && future, Body body) {
+		sections.emplace_back(new FutureSection<Future, Body>(std::forward<Future>(future), std::move(body)));
+		tailBuf.target = &sections.back()->buf;
+		tailStream.rdbuf(&tailBuf);
+		pump(false);
+	}
+
+	// Waits for the pending sections in order
+	void finish() { pump(true); }
+};
+
+
+// $(expr:spec) formatting. htmltpp parses the spec and passes it as template arguments,
+// nothing is parsed at runtime and the stream's formatting state is neither used nor changed
+namespace formatting {
+
+// Writes the digits of value so that they end right before end, returns the first digit
+inline char * writeDigits(char * end, unsigned long long value, unsigned base = 10, bool upper = false) {
+	const char * digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	do { *--end = digits[value % base]; value /= base; } while (value);
+	return end;
+}
+
+inline void writeFill(std::ostream & out, char c, int n) {
+	char fill[16];
+	std::memset(fill, c, sizeof(fill));
+	for (; n > 0; n -= (int)sizeof(fill)) out.write(fill, std::min<int>(n, (int)sizeof(fill)));
+}
+
+// Sign-aware padding: "-0042" with zero fill, "  -42" without
+inline void writePadded(std::ostream & out, bool negative, const char * body, std::size_t size, int width, bool zeroFill) {
+	int padding = width - (int)size - (negative ? 1 : 0);
+	if (!zeroFill) writeFill(out, ' ', padding);
+	if (negative) out.put('-');
+	if (zeroFill) writeFill(out, '0', padding);
+	out.write(body, (std::streamsize)size);
+}
+
+template<class T> bool isNegative(T value, std::true_type /*signed*/) { return value < T(); }
+template<class T> bool isNegative(T, std::false_type /*signed*/) { return false; }
+
+template<class T>
+void writeInteger(std::ostream & out, T value, unsigned base, bool upper, int width, bool zeroFill) {
+	static_assert(std::is_integral<T>::value, "integer format specifier (d, x, X, o) applied to a non-integer expression");
+	bool negative = isNegative(value, std::is_signed<T>());
+	unsigned long long magnitude = negative ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+	char buf[64];
+	char * begin = writeDigits(buf + sizeof(buf), magnitude, base, upper);
+	writePadded(out, negative, begin, (std::size_t)(buf + sizeof(buf) - begin), width, zeroFill);
+}
+
+// Fixed notation, rounded like printf: the exact product value * 10^precision is rounded to nearest, ties to even.
+// Values that don't fit 2^53 after scaling go through snprintf
+inline void writeFixed(std::ostream & out, double value, int precision, bool percent, int width, bool zeroFill) {
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+	char buf[400];
+	char * end = buf + sizeof(buf);
+	char * begin = end;
+	if (percent) { value *= 100; *--begin = '%'; }
+	bool negative = std::signbit(value);
+	double magnitude = std::fabs(value);
+
+	if (std::isnan(value)) { begin -= 3; std::memcpy(begin, "nan", 3); negative = false; } else
+	if (std::isinf(value)) { begin -= 3; std::memcpy(begin, "inf", 3); } else
+	if ((precision <= 15) && (magnitude * powers[precision] < 9007199254740992.0)) {
+		unsigned long long scale = (unsigned long long)powers[precision];
+		double product = magnitude * powers[precision];
+		double error = std::fma(magnitude, powers[precision], -product);  // product + error is exact
+		double floor = std::floor(product);
+		double half = (product - floor) - 0.5;  // exact, and larger than |error| unless zero
+		unsigned long long scaled = (unsigned long long)floor;
+		if ((half > 0) || ((half == 0) && ((error > 0) || ((error == 0) && (scaled & 1))))) scaled++;
+		if (precision > 0) {
+			char * fractionEnd = begin;
+			begin = writeDigits(begin, scaled % scale);
+			while (fractionEnd - begin < precision) *--begin = '0';
+			*--begin = '.';
+		}
+		begin = writeDigits(begin, scaled / scale);
+	} else {
+		int size = std::snprintf(buf, (std::size_t)(begin - buf), "%.*f", precision, magnitude);
+		// Whatever the C locale's decimal point is, it is the only non-digit
+		for (char * c = buf; c < buf + size; c++) { if ((*c < '0') || (*c > '9')) *c = '.'; }
+		std::memmove(begin - size, buf, (std::size_t)size);
+		begin -= size;
+	}
+	writePadded(out, negative, begin, (std::size_t)(end - begin), width, zeroFill);
+}
+
+// Digits that read back as the same double: Grisu2 (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+// with Integers"), in integer arithmetic, so unlike printf it doesn't depend on the locale. They are the shortest such
+// digits but for about one double in a thousand, which gets one digit more.
+// Numbers are 64-bit significands with a binary exponent, scaled by a cached power of ten so that the digits come
+// out of the integer part of the product and fit 32 bits
+namespace grisu {
+
+struct Fp {
+	std::uint64_t f;
+	int e;
+};
+
+// Upper 64 bits of the product, rounded
+inline Fp multiply(Fp x, Fp y) {
+	std::uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFFu, c = y.f >> 32, d = y.f & 0xFFFFFFFFu;
+	std::uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	std::uint64_t middle = (bd >> 32) + (ad & 0xFFFFFFFFu) + (bc & 0xFFFFFFFFu) + (1ULL << 31);
+	Fp res = { ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64 };
+	return res;
+}
+
+inline Fp normalize(Fp x) {
+	while (!(x.f >> 63)) { x.f <<= 1; x.e--; }
+	return x;
+}
+
+// 10^k for k = -300, -292, ..., 324 as a normalized Fp
+struct CachedPower {
+	std::uint64_t f;
+	int e;
+	int k;
+};
+
+// The cached power c = 10^-k such that the product of c and a normalized Fp with exponent e has an exponent in
+// [-60, -32]
+inline const CachedPower & cachedPower(int e) {
+	static const CachedPower powers[] = {
+		{ 0xAB70FE17C79AC6CAULL, -1060, -300 }, { 0xFF77B1FCBEBCDC4FULL, -1034, -292 }, { 0xBE5691EF416BD60CULL, -1007, -284 },
+		{ 0x8DD01FAD907FFC3CULL, -980, -276 }, { 0xD3515C2831559A83ULL, -954, -268 }, { 0x9D71AC8FADA6C9B5ULL, -927, -260 },
+		{ 0xEA9C227723EE8BCBULL, -901, -252 }, { 0xAECC49914078536DULL, -874, -244 }, { 0x823C12795DB6CE57ULL, -847, -236 },
+		{ 0xC21094364DFB5637ULL, -821, -228 }, { 0x9096EA6F3848984FULL, -794, -220 }, { 0xD77485CB25823AC7ULL, -768, -212 },
+		{ 0xA086CFCD97BF97F4ULL, -741, -204 }, { 0xEF340A98172AACE5ULL, -715, -196 }, { 0xB23867FB2A35B28EULL, -688, -188 },
+		{ 0x84C8D4DFD2C63F3BULL, -661, -180 }, { 0xC5DD44271AD3CDBAULL, -635, -172 }, { 0x936B9FCEBB25C996ULL, -608, -164 },
+		{ 0xDBAC6C247D62A584ULL, -582, -156 }, { 0xA3AB66580D5FDAF6ULL, -555, -148 }, { 0xF3E2F893DEC3F126ULL, -529, -140 },
+		{ 0xB5B5ADA8AAFF80B8ULL, -502, -132 }, { 0x87625F056C7C4A8BULL, -475, -124 }, { 0xC9BCFF6034C13053ULL, -449, -116 },
+		{ 0x964E858C91BA2655ULL, -422, -108 }, { 0xDFF9772470297EBDULL, -396, -100 }, { 0xA6DFBD9FB8E5B88FULL, -369, -92 },
+		{ 0xF8A95FCF88747D94ULL, -343, -84 }, { 0xB94470938FA89BCFULL, -316, -76 }, { 0x8A08F0F8BF0F156BULL, -289, -68 },
+		{ 0xCDB02555653131B6ULL, -263, -60 }, { 0x993FE2C6D07B7FACULL, -236, -52 }, { 0xE45C10C42A2B3B06ULL, -210, -44 },
+		{ 0xAA242499697392D3ULL, -183, -36 }, { 0xFD87B5F28300CA0EULL, -157, -28 }, { 0xBCE5086492111AEBULL, -130, -20 },
+		{ 0x8CBCCC096F5088CCULL, -103, -12 }, { 0xD1B71758E219652CULL, -77, -4 }, { 0x9C40000000000000ULL, -50, 4 },
+		{ 0xE8D4A51000000000ULL, -24, 12 }, { 0xAD78EBC5AC620000ULL, 3, 20 }, { 0x813F3978F8940984ULL, 30, 28 },
+		{ 0xC097CE7BC90715B3ULL, 56, 36 }, { 0x8F7E32CE7BEA5C70ULL, 83, 44 }, { 0xD5D238A4ABE98068ULL, 109, 52 },
+		{ 0x9F4F2726179A2245ULL, 136, 60 }, { 0xED63A231D4C4FB27ULL, 162, 68 }, { 0xB0DE65388CC8ADA8ULL, 189, 76 },
+		{ 0x83C7088E1AAB65DBULL, 216, 84 }, { 0xC45D1DF942711D9AULL, 242, 92 }, { 0x924D692CA61BE758ULL, 269, 100 },
+		{ 0xDA01EE641A708DEAULL, 295, 108 }, { 0xA26DA3999AEF774AULL, 322, 116 }, { 0xF209787BB47D6B85ULL, 348, 124 },
+		{ 0xB454E4A179DD1877ULL, 375, 132 }, { 0x865B86925B9BC5C2ULL, 402, 140 }, { 0xC83553C5C8965D3DULL, 428, 148 },
+		{ 0x952AB45CFA97A0B3ULL, 455, 156 }, { 0xDE469FBD99A05FE3ULL, 481, 164 }, { 0xA59BC234DB398C25ULL, 508, 172 },
+		{ 0xF6C69A72A3989F5CULL, 534, 180 }, { 0xB7DCBF5354E9BECEULL, 561, 188 }, { 0x88FCF317F22241E2ULL, 588, 196 },
+		{ 0xCC20CE9BD35C78A5ULL, 614, 204 }, { 0x98165AF37B2153DFULL, 641, 212 }, { 0xE2A0B5DC971F303AULL, 667, 220 },
+		{ 0xA8D9D1535CE3B396ULL, 694, 228 }, { 0xFB9B7CD9A4A7443CULL, 720, 236 }, { 0xBB764C4CA7A44410ULL, 747, 244 },
+		{ 0x8BAB8EEFB6409C1AULL, 774, 252 }, { 0xD01FEF10A657842CULL, 800, 260 }, { 0x9B10A4E5E9913129ULL, 827, 268 },
+		{ 0xE7109BFBA19C0C9DULL, 853, 276 }, { 0xAC2820D9623BF429ULL, 880, 284 }, { 0x80444B5E7AA7CF85ULL, 907, 292 },
+		{ 0xBF21E44003ACDD2DULL, 933, 300 }, { 0x8E679C2F5E44FF8FULL, 960, 308 }, { 0xD433179D9C8CB841ULL, 986, 316 },
+		{ 0x9E19DB92B4E31BA9ULL, 1013, 324 },
+	};
+	int f = -60 - e - 1;
+	int k = (f * 78913) / (1 << 18) + (f > 0 ? 1 : 0);  // ceil(f * log10(2))
+	return powers[(300 + k + 7) / 8];
+}
+
+// Steps the last digit down while that gets closer to w and stays within the rounding interval
+inline void roundLastDigit(char * digits, int size, std::uint64_t distance, std::uint64_t delta, std::uint64_t rest, std::uint64_t tenK) {
+	while ((rest < distance) && (delta - rest >= tenK) && ((rest + tenK < distance) || (distance - rest > rest + tenK - distance))) {
+		digits[size - 1]--;
+		rest += tenK;
+	}
+}
+
+// Writes the digits of a positive finite value, which is then digits * 10^exponent. Returns the number of digits, at
+// most 17
+inline int shortestDigits(char * digits, double value, int & exponent) {
+	std::uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	std::uint64_t fraction = bits & ((1ULL << 52) - 1);
+	int biased = (int)(bits >> 52);
+	Fp v = biased ? Fp{ fraction | (1ULL << 52), biased - 1075 } : Fp{ fraction, -1074 };
+
+	// The boundaries halfway to the neighbouring doubles; the lower one is closer at powers of two
+	Fp plus = normalize(Fp{ 2 * v.f + 1, v.e - 1 });
+	Fp minus = ((fraction == 0) && (biased > 1)) ? Fp{ 4 * v.f - 1, v.e - 2 } : Fp{ 2 * v.f - 1, v.e - 1 };
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+
+	const CachedPower & cached = cachedPower(plus.e);
+	Fp c = { cached.f, cached.e };
+	Fp w = multiply(normalize(v), c);
+	Fp low = multiply(minus, c), high = multiply(plus, c);
+	// Products are off by up to one unit, so the interval is narrowed by one on each side
+	low.f++;
+	high.f--;
+	exponent = -cached.k;
+
+	std::uint64_t delta = high.f - low.f, distance = high.f - w.f;
+	int shift = -high.e;
+	std::uint64_t one = 1ULL << shift;
+	std::uint32_t integral = (std::uint32_t)(high.f >> shift);
+	std::uint64_t fractional = high.f & (one - 1);
+
+	std::uint32_t power = 1000000000;
+	int count = 10;
+	while (power > integral && count > 1) { power /= 10; count--; }
+	int size = 0;
+	while (count > 0) {
+		digits[size++] = (char)('0' + integral / power);
+		integral %= power;
+		count--;
+		std::uint64_t rest = ((std::uint64_t)integral << shift) + fractional;
+		if (rest <= delta) {
+			exponent += count;
+			roundLastDigit(digits, size, distance, delta, rest, (std::uint64_t)power << shift);
+			return size;
+		}
+		power /= 10;
+	}
+	for (;;) {
+		fractional *= 10;
+		delta *= 10;
+		distance *= 10;
+		digits[size++] = (char)('0' + (fractional >> shift));
+		fractional &= one - 1;
+		exponent--;
+		if (fractional <= delta) break;
+	}
+	roundLastDigit(digits, size, distance, delta, fractional, one);
+	return size;
+}
+
+}
+
+// A short representation that reads back as value, laid out like printf's %.15g: fixed notation for decimal
+// exponents in [-4, 15), scientific otherwise. Returns the end of what's written to buf, which has room for 32 chars
+inline char * writeShortest(char * buf, double value) {
+	char * p = buf;
+	if (std::signbit(value)) { *p++ = '-'; value = -value; }
+	if (value == 0) { *p++ = '0'; return p; }
+	char digits[32];
+	int exponent;
+	int size = grisu::shortestDigits(digits, value, exponent);
+	int point = size + exponent;  // value is 0.digits * 10^point
+	if ((point > -4) && (point <= 15)) {
+		if (point <= 0) {
+			*p++ = '0';
+			*p++ = '.';
+			for (int i = point; i < 0; i++) *p++ = '0';
+			std::memcpy(p, digits, (std::size_t)size);
+			return p + size;
+		}
+		if (point >= size) {
+			std::memcpy(p, digits, (std::size_t)size);
+			p += size;
+			for (int i = size; i < point; i++) *p++ = '0';
+			return p;
+		}
+		std::memcpy(p, digits, (std::size_t)point);
+		p += point;
+		*p++ = '.';
+		std::memcpy(p, digits + point, (std::size_t)(size - point));
+		return p + size - point;
+	}
+	*p++ = digits[0];
+	if (size > 1) {
+		*p++ = '.';
+		std::memcpy(p, digits + 1, (std::size_t)(size - 1));
+		p += size - 1;
+	}
+	*p++ = 'e';
+	int e = point - 1;
+	*p++ = (e < 0) ? '-' : '+';
+	if (e < 0) e = -e;
+	if (e >= 100) *p++ = (char)('0' + e / 100);
+	*p++ = (char)('0' + e / 10 % 10);
+	*p++ = (char)('0' + e % 10);
+	return p;
+}
+
+template<char Type> struct IsFloatingType : std::integral_constant<bool, (Type == 'f') || (Type == '%')> {};
+
+template<char Type, int Width, int Precision, bool ZeroFill, class T>
+void write(std::ostream & out, const T & value, std::false_type) {
+	static_assert(Precision < 0, "precision is not allowed with integer format specifiers");
+	writeInteger(out, value, (Type == 'x' || Type == 'X') ? 16 : (Type == 'o') ? 8 : 10, Type == 'X', Width, ZeroFill);
+}
+
+template<char Type, int Width, int Precision, bool ZeroFill, class T>
+void write(std::ostream & out, const T & value, std::true_type) {
+	static_assert(std::is_arithmetic<T>::value, "floating point format specifier (f, %) applied to a non-arithmetic expression");
+	static_assert(Precision <= 64, "precision is too large");
+	writeFixed(out, (double)value, (Precision < 0) ? 6 : Precision, Type == '%', Width, ZeroFill);
+}
+
+}
+
+// Type is one of d x X o f %, Width is 0 and Precision is -1 when not specified
+template<char Type, int Width, int Precision, bool ZeroFill, class T>
+void writeFormatted(std::ostream & out, const T & value) {
+	static_assert((Type == 'd') || (Type == 'x') || (Type == 'X') || (Type == 'o') || (Type == 'f') || (Type == '%'), "unknown format specifier type");
+	formatting::write<Type, Width, Precision, ZeroFill>(out, value, formatting::IsFloatingType<Type>());
+}
+
+
+// Where an interpolation lands, as detected by htmltpp from the surrounding static text
+enum class Escape {
+	HtmlText,               // <p>$x</p>
+	HtmlAttribute,          // <p title="$x">
+	HtmlUnquotedAttribute,  // <p title=$x>, <p $x>
+	JsString,               // <script>var x = "$x";</script>, <a onclick="f('$x')">
+	JsValue,                // <script>var x = $x;</script>, strings are quoted, only strings and numbers are allowed
+	JsAttributeValue,       // <a onclick="f($x)">, same with the quotes written as &quot;
+	Css,                    // <style>p { color: $x; }</style>, <p style="color: $x">
+	Url,                    // <a href="$x">, a whole URL: javascript:, vbscript: and data: ones are replaced
+	UrlComponent,           // <a href="/?q=$x">, reserved characters are percent-encoded too
+	JsonValue,              // {"name": $x} in .jsont templates, strings are quoted
+	JsonString              // {"name": "$x"} in .jsont templates
+};
+
+namespace escaping {
+
+#if defined(__AVX2__)
+struct Simd {
+	typedef __m256i Vector;
+	static const std::size_t size = 32;
+	static Vector load(const char * p) { return _mm256_loadu_si256((const __m256i *)p); }
+	static Vector eq(Vector x, char c) { return _mm256_cmpeq_epi8(x, _mm256_set1_epi8(c)); }
+	static Vector atMost(Vector x, unsigned char c) { return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8((char)c)), x); }
+	static Vector atLeast(Vector x, unsigned char c) { return _mm256_cmpeq_epi8(_mm256_max_epu8(x, _mm256_set1_epi8((char)c)), x); }
+	static Vector any(Vector a, Vector b) { return _mm256_or_si256(a, b); }
+	static Vector all(Vector a, Vector b) { return _mm256_and_si256(a, b); }
+	static Vector none(Vector x) { return _mm256_xor_si256(x, _mm256_set1_epi8(-1)); }
+	static std::uint32_t mask(Vector x) { return (std::uint32_t)_mm256_movemask_epi8(x); }
+};
+#define SERENITY_TEMPLATER_SIMD 1
+#elif defined(__SSE2__)
+struct Simd {
+	typedef __m128i Vector;
+	static const std::size_t size = 16;
+	static Vector load(const char * p) { return _mm_loadu_si128((const __m128i *)p); }
+	static Vector eq(Vector x, char c) { return _mm_cmpeq_epi8(x, _mm_set1_epi8(c)); }
+	static Vector atMost(Vector x, unsigned char c) { return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8((char)c)), x); }
+	static Vector atLeast(Vector x, unsigned char c) { return _mm_cmpeq_epi8(_mm_max_epu8(x, _mm_set1_epi8((char)c)), x); }
+	static Vector any(Vector a, Vector b) { return _mm_or_si128(a, b); }
+	static Vector all(Vector a, Vector b) { return _mm_and_si128(a, b); }
+	static Vector none(Vector x) { return _mm_xor_si128(x, _mm_set1_epi8(-1)); }
+	static std::uint32_t mask(Vector x) { return (std::uint32_t)_mm_movemask_epi8(x); }
+};
+#define SERENITY_TEMPLATER_SIMD 1
+#endif
+
+inline void writeHtmlEntity(std::ostream & out, char c) {
+	switch (c) {
+		case '&':  out.write("&amp;", 5); break;
+		case '<':  out.write("&lt;", 4); break;
+		case '>':  out.write("&gt;", 4); break;
+		case '"':  out.write("&#34;", 5); break;
+		case '\'': out.write("&#39;", 5); break;
+		default:   out.put(c);
+	}
+}
+
+inline void writeHexEscape(std::ostream & out, const char * prefix, std::size_t prefixSize, char c) {
+	const char * digits = "0123456789ABCDEF";
+	char buf[8];
+	std::memcpy(buf, prefix, prefixSize);
+	buf[prefixSize] = digits[(unsigned char)c >> 4];
+	buf[prefixSize + 1] = digits[(unsigned char)c & 15];
+	out.write(buf, (std::streamsize)prefixSize + 2);
+}
+
+// Per context: which bytes need escaping (scalar and SIMD versions must agree) and what they are replaced with
+template<Escape E> struct Traits;
+
+template<> struct Traits<Escape::HtmlText> {
+	static bool special(unsigned char c) { return (c == '&') || (c == '<') || (c == '>'); }
+#if defined(SERENITY_TEMPLATER_SIMD)
+	static Simd::Vector special(Simd::Vector x) { return Simd::any(Simd::any(Simd::eq(x, '&'), Simd::eq(x, '<')), Simd::eq(x, '>')); }
+#endif
+	static void replace(std::ostream & out, char c) { writeHtmlEntity(out, c); }
+};
+
+template<> struct Traits<Escape::HtmlAttribute> {
+	static bool special(unsigned char c) { return (c == '&') || (c == '<') || (c == '>') || (c == '"') || (c == '\''); }
+#if defined(SERENITY_TEMPLATER_SIMD)
+	static Simd::Vector special(Simd::Vector x) {
+		return Simd::any(Simd::any(Simd::any(Simd::eq(x, '&'), Simd::eq(x, '<')), Simd::any(Simd::eq(x, '>'), Simd::eq(x, '"'))), Simd::eq(x, '\''));
+	}
+#endif
+	static void replace(std::ostream & out, char c) { writeHtmlEntity(out, c); }
+};
+
+// Also whitespace, which ends an unquoted value, and = ` / which browsers and older parsers treat specially there.
+// Those become numeric character references
+template<> struct Traits<Escape::HtmlUnquotedAttribute> {
+	static bool special(unsigned char c) {
+		return (c <= 0x20) || (c == '&') || (c == '<') || (c == '>') || (c == '"') || (c == '\'') || (c == '=') || (c == '`') || (c == '/');
+	}
+#if defined(SERENITY_TEMPLATER_SIMD)
+	static Simd::Vector special(Simd::Vector x) {
+		Simd::Vector html = Simd::any(Simd::any(Simd::eq(x, '&'), Simd::eq(x, '<')), Simd::any(Simd::eq(x, '>'), Simd::eq(x, '"')));
+		Simd::Vector others = Simd::any(Simd::any(Simd::eq(x, '\''), Simd::eq(x, '=')), Simd::any(Simd::eq(x, '`'), Simd::eq(x, '/')));
+		return Simd::any(Simd::atMost(x, 0x20), Simd::any(html, others));
+	}
+#endif
+	static void replace(std::ostream & out, char c) {
+		if ((c == '&') || (c == '<') || (c == '>') || (c == '"') || (c == '\'')) { writeHtmlEntity(out, c); return; }
+		writeHexEscape(out, "&#x", 3, c);
+		out.put(';');
+	}
+};
+
+// Everything that could end the string, the script element or the enclosing attribute becomes \u00XX, also ` and ${
+// which end a template literal or start code in it
+template<> struct Traits<Escape::JsString> {
+	static bool special(unsigned char c) {
+		return (c < 0x20) || (c == '\\') || (c == '\'') || (c == '"') || (c == '<') || (c == '>') || (c == '&') || (c == '`') || (c == '$') || (c == '{');
+	}
+#if defined(SERENITY_TEMPLATER_SIMD)
+	static Simd::Vector special(Simd::Vector x) {
+		Simd::Vector quotes = Simd::any(Simd::any(Simd::eq(x, '\''), Simd::eq(x, '"')), Simd::eq(x, '`'));
+		Simd::Vector html = Simd::any(Simd::any(Simd::eq(x, '<'), Simd::eq(x, '>')), Simd::eq(x, '&'));
+		Simd::Vector substitution = Simd::any(Simd::eq(x, '$'), Simd::eq(x, '{'));
+		return Simd::any(Simd::any(Simd::atMost(x, 0x1f), Simd::eq(x, '\\')), Simd::any(quotes, Simd::any(html, substitution)));
+	}
+#endif
+	static void replace(std::ostream & out, char c) { writeHexEscape(out, "\\u00", 4, c); }
+};
+
+// ASCII other than letters and digits becomes a CSS escape, \XX and a space, which is text in any CSS value and
+// contains nothing an attribute or the style element could end on
+template<> struct Traits<Escape::Css> {
+	static bool special(unsigned char c) { return (c < 0x80) && !(((c >= '0') && (c <= '9')) || ((c >= 'A') && (c <= 'Z')) || ((c >= 'a') && (c <= 'z'))); }
+#if defined(SERENITY_TEMPLATER_SIMD)
+	static Simd::Vector special(Simd::Vector x) {
+		Simd::Vector digits = Simd::all(Simd::atLeast(x, '0'), Simd::atMost(x, '9'));
+		Simd::Vector upper = Simd::all(Simd::atLeast(x, 'A'), Simd::atMost(x, 'Z'));
+		Simd::Vector lower = Simd::all(Simd::atLeast(x, 'a'), Simd::atMost(x, 'z'));
+		return Simd::none(Simd::any(Simd::any(digits, upper), Simd::any(lower, Simd::atLeast(x, 0x80))));
+	}
+#endif
+	static void replace(std::ostream & out, char c) {
+		writeHexEscape(out, "\\", 1, c);
+		out.put(' ');
+	}
+};
+
+// Bytes not allowed in URLs are percent-encoded, & is written as &amp; because URLs live in attributes
+template<> struct Traits<Escape::Url> {
+	static bool special(unsigned char c) {
+		return (c <= 0x20) || (c >= 0x7f) || (c == '"') || (c == '\'') || (c == '<') || (c == '>') || (c == '\\') ||
+		       (c == '^') || (c == '`') || (c == '{') || (c == '|') || (c == '}') || (c == '&');
+	}
+#if defined(SERENITY_TEMPLATER_SIMD)
+	static Simd::Vector special(Simd::Vector x) {
+		Simd::Vector quotes = Simd::any(Simd::any(Simd::eq(x, '"'), Simd::eq(x, '\'')), Simd::eq(x, '`'));
+		Simd::Vector brackets = Simd::any(Simd::any(Simd::eq(x, '<'), Simd::eq(x, '>')), Simd::any(Simd::eq(x, '{'), Simd::eq(x, '}')));
+		Simd::Vector others = Simd::any(Simd::any(Simd::eq(x, '\\'), Simd::eq(x, '^')), Simd::any(Simd::eq(x, '|'), Simd::eq(x, '&')));
+		return Simd::any(Simd::any(Simd::atMost(x, 0x20), Simd::atLeast(x, 0x7f)), Simd::any(quotes, Simd::any(brackets, others)));
+	}
+#endif
+	static void replace(std::ostream & out, char c) {
+		if (c == '&') out.write("&amp;", 5); else writeHexEscape(out, "%", 1, c);
+	}
+};
+
+template<> struct Traits<Escape::UrlComponent> {
+	static bool special(unsigned char c) {
+		return Traits<Escape::Url>::special(c) || (c == '=') || (c == '?') || (c == '#') || (c == '+') || (c == '%');
+	}
+#if defined(SERENITY_TEMPLATER_SIMD)
+	static Simd::Vector special(Simd::Vector x) {
+		Simd::Vector reserved = Simd::any(Simd::any(Simd::eq(x, '='), Simd::eq(x, '?')), Simd::any(Simd::any(Simd::eq(x, '#'), Simd::eq(x, '+')), Simd::eq(x, '%')));
+		return Simd::any(Traits<Escape::Url>::special(x), reserved);
+	}
+#endif
+	static void replace(std::ostream & out, char c) { writeHexEscape(out, "%", 1, c); }
+};
+
+template<> struct Traits<Escape::JsonString> {
+	static bool special(unsigned char c) { return (c < 0x20) || (c == '"') || (c == '\\'); }
+#if defined(SERENITY_TEMPLATER_SIMD)
+	static Simd::Vector special(Simd::Vector x) { return Simd::any(Simd::atMost(x, 0x1f), Simd::any(Simd::eq(x, '"'), Simd::eq(x, '\\'))); }
+#endif
+	static void replace(std::ostream & out, char c) {
+		switch (c) {
+			case '"':  out.write("\\\"", 2); break;
+			case '\\': out.write("\\\\", 2); break;
+			case '\n': out.write("\\n", 2); break;
+			case '\r': out.write("\\r", 2); break;
+			case '\t': out.write("\\t", 2); break;
+			case '\b': out.write("\\b", 2); break;
+			case '\f': out.write("\\f", 2); break;
+			default:   writeHexEscape(out, "\\u00", 4, c);
+		}
+	}
+};
+
+// Copies runs of clean bytes with one write, a SIMD block at a time, and stops only on bytes that need escaping
+template<Escape E>
+void escape(std::ostream & out, const char * begin, std::size_t size) {
+	typedef Traits<E> T;
+	const char * end = begin + size;
+	const char * run = begin;  // first byte not written yet
+	const char * p = begin;
+#if defined(SERENITY_TEMPLATER_SIMD)
+	for (; (std::size_t)(end - p) >= Simd::size; p += Simd::size) {
+		for (std::uint32_t mask = Simd::mask(T::special(Simd::load(p))); mask; mask &= mask - 1) {
+			const char * special = p + __builtin_ctz(mask);
+			out.write(run, special - run);
+			T::replace(out, *special);
+			run = special + 1;
+		}
+	}
+#endif
+	for (; p < end; p++) {
+		if (T::special((unsigned char)*p)) {
+			out.write(run, p - run);
+			T::replace(out, *p);
+			run = p + 1;
+		}
+	}
+	out.write(run, end - run);
+}
+
+template<class T> struct IsString : std::false_type {};
+template<> struct IsString<char *> : std::true_type {};
+template<> struct IsString<const char *> : std::true_type {};
+template<> struct IsString<signed char *> : std::true_type {};
+template<> struct IsString<const signed char *> : std::true_type {};
+template<> struct IsString<unsigned char *> : std::true_type {};
+template<> struct IsString<const unsigned char *> : std::true_type {};
+template<class Traits, class Allocator> struct IsString<std::basic_string<char, Traits, Allocator>> : std::true_type {};
+
+inline const char * data(const char * s) { return s; }
+inline std::size_t size(const char * s) { return std::strlen(s); }
+inline const char * data(const signed char * s) { return (const char *)s; }
+inline std::size_t size(const signed char * s) { return std::strlen((const char *)s); }
+inline const char * data(const unsigned char * s) { return (const char *)s; }
+inline std::size_t size(const unsigned char * s) { return std::strlen((const char *)s); }
+template<class Traits, class Allocator> const char * data(const std::basic_string<char, Traits, Allocator> & s) { return s.data(); }
+template<class Traits, class Allocator> std::size_t size(const std::basic_string<char, Traits, Allocator> & s) { return s.size(); }
+
+template<Escape E>
+void writeString(std::ostream & out, const char * s, std::size_t size) { escape<E>(out, s, size); }
+
+template<>
+inline void writeString<Escape::JsonValue>(std::ostream & out, const char * s, std::size_t size) {
+	out.put('"');
+	escape<Escape::JsonString>(out, s, size);
+	out.put('"');
+}
+
+// Whether a URL runs code: its scheme, read like browsers do, skipping leading whitespace and controls and
+// tabs and newlines anywhere, is javascript, vbscript or data
+inline bool isScriptUrl(const char * s, std::size_t size) {
+	char scheme[10];
+	std::size_t n = 0;
+	for (const char * p = s; p != s + size; p++) {
+		unsigned char c = (unsigned char)*p;
+		if (((n == 0) && (c <= 0x20)) || (c == '\t') || (c == '\n') || (c == '\r')) continue;
+		if (c == ':') {
+			return ((n == 10) && (std::memcmp(scheme, "javascript", 10) == 0)) || ((n == 8) && (std::memcmp(scheme, "vbscript", 8) == 0)) ||
+			       ((n == 4) && (std::memcmp(scheme, "data", 4) == 0));
+		}
+		if ((n == sizeof(scheme)) || !(((c | 0x20) >= 'a') && ((c | 0x20) <= 'z'))) return false;  // not a blocked scheme
+		scheme[n++] = (char)(c | 0x20);
+	}
+	return false;
+}
+
+template<>
+inline void writeString<Escape::Url>(std::ostream & out, const char * s, std::size_t size) {
+	if (isScriptUrl(s, size)) out.write("about:invalid", 13); else escape<Escape::Url>(out, s, size);
+}
+
+template<>
+inline void writeString<Escape::JsValue>(std::ostream & out, const char * s, std::size_t size) {
+	out.put('"');
+	escape<Escape::JsString>(out, s, size);
+	out.put('"');
+}
+
+// The attribute can be quoted with either quote, the HTML parser turns &quot; back into one for the script
+template<>
+inline void writeString<Escape::JsAttributeValue>(std::ostream & out, const char * s, std::size_t size) {
+	out.write("&quot;", 6);
+	escape<Escape::JsString>(out, s, size);
+	out.write("&quot;", 6);
+}
+
+// JSON numbers don't depend on the stream's formatting flags or locale
+inline void writeJsonNumber(std::ostream & out, bool value) {
+	if (value) out.write("true", 4); else out.write("false", 5);
+}
+
+// Digits that read back as the same value, see formatting::writeShortest(), non-finite values become null
+inline void writeJsonNumber(std::ostream & out, double value) {
+	if (!std::isfinite(value)) { out.write("null", 4); return; }
+	char buf[32];
+	out.write(buf, formatting::writeShortest(buf, value) - buf);
+}
+
+template<class T>
+void writeJsonNumber(std::ostream & out, T value) {
+	static_assert(std::is_arithmetic<T>::value, "");
+	if (std::is_floating_point<T>::value) { writeJsonNumber(out, (double)value); return; }
+	bool negative = formatting::isNegative(value, std::is_signed<T>());
+	char buf[24];
+	char * begin = formatting::writeDigits(buf + sizeof(buf), negative ? 0ULL - (unsigned long long)value : (unsigned long long)value);
+	if (negative) *--begin = '-';
+	out.write(begin, buf + sizeof(buf) - begin);
+}
+
+template<class T>
+void writeOther(std::ostream & out, const T & value, std::true_type /*json number*/) { writeJsonNumber(out, value); }
+
+template<class T>
+void writeOther(std::ostream & out, const T & value, std::false_type) { out << value; }
+
+template<Escape E, class T>
+void write(std::ostream & out, const T & value, std::true_type /*string*/) { writeString<E>(out, data(value), size(value)); }
+
+// operator<< writes all three character types as characters, so they are text to escape
+template<Escape E>
+void write(std::ostream & out, char value, std::false_type) { writeString<E>(out, &value, 1); }
+
+template<Escape E>
+void write(std::ostream & out, signed char value, std::false_type) { write<E>(out, (char)value, std::false_type()); }
+
+template<Escape E>
+void write(std::ostream & out, unsigned char value, std::false_type) { write<E>(out, (char)value, std::false_type()); }
+
+// Numbers, manipulators and everything else that isn't text. JSON values and script code only take numbers:
+// operator<< of anything else is neither JSON nor safe
+template<Escape E, class T>
+void write(std::ostream & out, const T & value, std::false_type) {
+	static_assert((E != Escape::JsonValue) || std::is_arithmetic<T>::value,
+	              "only strings, numbers and bool are JSON values, write other types with $raw() or inside a string literal");
+	static_assert(((E != Escape::JsValue) && (E != Escape::JsAttributeValue)) || std::is_arithmetic<T>::value,
+	              "only strings and numbers can be interpolated into script code, write it inside a string literal or use $raw()");
+	writeOther(out, value, std::integral_constant<bool,
+		((E == Escape::JsonValue) || (E == Escape::JsValue) || (E == Escape::JsAttributeValue)) && std::is_arithmetic<T>::value>());
+}
+
+}
+
+// What htmltpp emits for $x and $(x). Strings and chars are escaped for the context E,
+// everything else (numbers, manipulators, user types) goes to operator<< as is, decided at compile time
+template<Escape E, class T>
+void writeEscaped(std::ostream & out, const T & value) {
+	escaping::write<E>(out, value, escaping::IsString<typename std::decay<T>::type>());
+}
+
+
+// $foreach(x : range)prefix$x suffix$end, which htmltpp turns into one writeEach() call.
+// Integers from contiguous ranges are formatted into a local buffer with the static text in between
+namespace bulk {
+
+// What writeEscaped() writes as a number; bool and the character types are not
+template<class T> struct IsInteger : std::integral_constant<bool, std::is_integral<T>::value &&
+	!std::is_same<T, bool>::value && !std::is_same<T, char>::value && !std::is_same<T, signed char>::value &&
+	!std::is_same<T, unsigned char>::value && !std::is_same<T, wchar_t>::value &&
+	!std::is_same<T, char16_t>::value && !std::is_same<T, char32_t>::value> {};
+
+#if defined(__SSE2__)
+// The 8 decimal digits of value < 10^8 with leading zeros, in bytes 0-7 (W. Mula's SSE2 conversion):
+// two 4-digit halves, then each half divided by 1000, 100, 10 and 1 at once with fixed-point multiplications
+inline __m128i digits8(std::uint32_t value) {
+	const __m128i divPowers = _mm_setr_epi16(8389, 5243, 13108, (short)32768, 8389, 5243, 13108, (short)32768);
+	const __m128i shiftPowers = _mm_setr_epi16(1 << 7, 1 << 11, 1 << 13, (short)(1 << 15), 1 << 7, 1 << 11, 1 << 13, (short)(1 << 15));
+	__m128i abcdefgh = _mm_cvtsi32_si128((int)value);
+	__m128i abcd = _mm_srli_epi64(_mm_mul_epu32(abcdefgh, _mm_set1_epi32((int)0xd1b71759)), 45);
+	__m128i efgh = _mm_sub_epi32(abcdefgh, _mm_mul_epu32(abcd, _mm_set1_epi32(10000)));
+	__m128i halves = _mm_slli_epi64(_mm_unpacklo_epi16(abcd, efgh), 2);
+	halves = _mm_unpacklo_epi16(halves, halves);
+	__m128i prefixes = _mm_mulhi_epu16(_mm_mulhi_epu16(_mm_unpacklo_epi32(halves, halves), divPowers), shiftPowers);  // a ab abc abcd e ef efg efgh
+	__m128i digits = _mm_sub_epi16(prefixes, _mm_slli_epi64(_mm_mullo_epi16(prefixes, _mm_set1_epi16(10)), 16));
+	return _mm_add_epi8(_mm_packus_epi16(digits, _mm_setzero_si128()), _mm_set1_epi8('0'));
+}
+
+// Writes value at p without leading zeros, returns the end
+inline char * writeDecimal(char * p, unsigned long long value) {
+	if (value >= 100000000) {
+		p = writeDecimal(p, value / 100000000);
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(p), digits8((std::uint32_t)(value % 100000000)));
+		return p + 8;
+	}
+	__m128i digits = digits8((std::uint32_t)value);
+	unsigned zeros = (unsigned)__builtin_ctz(~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(digits, _mm_set1_epi8('0'))) | 0x80);
+	char buf[16];
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(buf), digits);
+	std::memcpy(p, buf + zeros, 8 - zeros);
+	return p + 8 - zeros;
+}
+#else
+inline char * writeDecimal(char * p, unsigned long long value) {
+	char buf[20];
+	char * begin = formatting::writeDigits(buf + sizeof(buf), value);
+	std::size_t size = (std::size_t)(buf + sizeof(buf) - begin);
+	std::memcpy(p, begin, size);
+	return p + size;
+}
+#endif
+
+// What the loop would have written
+template<Escape E, class Stream, class Range>
+void writeRange(Stream & out, const Range & range, const char * prefix, std::size_t prefixSize, const char * suffix, std::size_t suffixSize) {
+	for (auto && item : range) {
+		if (prefixSize) writeStatic(out, prefix, prefixSize);
+		writeEscaped<E>(out, item);
+		if (suffixSize) writeStatic(out, suffix, suffixSize);
+	}
+}
+
+template<class T>
+struct Span {
+	const T * first;
+	const T * last;
+	const T * begin() const { return first; }
+	const T * end() const { return last; }
+};
+
+// Whether operator<< writes integers as plain decimals: no $(std::hex), $(std::setw(n)), imbued locale and the like
+inline bool plainDecimal(std::ostream & out) {
+	return (out.flags() == (std::ios_base::dec | std::ios_base::skipws)) && (out.width() == 0) && (out.getloc() == std::locale::classic());
+}
+
+template<Escape E, class Stream, class T>
+void writeContiguous(Stream & out, const T * values, std::size_t count,
+                     const char * prefix, std::size_t prefixSize, const char * suffix, std::size_t suffixSize, std::true_type /*integer*/) {
+	char buf[4096];
+	const std::size_t itemSize = prefixSize + 21 + suffixSize;  // a sign and up to 20 digits
+	if ((itemSize > sizeof(buf)) || !plainDecimal(out)) return writeRange<E>(out, Span<T>{values, values + count}, prefix, prefixSize, suffix, suffixSize);
+	char * p = buf;
+	for (const T * value = values; value != values + count; value++) {
+		if (p + itemSize > buf + sizeof(buf)) {
+			out.write(buf, p - buf);
+			p = buf;
+		}
+		if (prefixSize) { std::memcpy(p, prefix, prefixSize); p += prefixSize; }
+		bool negative = formatting::isNegative(*value, std::is_signed<T>());
+		if (negative) *p++ = '-';
+		p = writeDecimal(p, negative ? 0ULL - (unsigned long long)*value : (unsigned long long)*value);
+		if (suffixSize) { std::memcpy(p, suffix, suffixSize); p += suffixSize; }
+	}
+	out.write(buf, p - buf);
+}
+
+template<Escape E, class Stream, class T>
+void writeContiguous(Stream & out, const T * values, std::size_t count,
+                     const char * prefix, std::size_t prefixSize, const char * suffix, std::size_t suffixSize, std::false_type) {
+	writeRange<E>(out, Span<T>{values, values + count}, prefix, prefixSize, suffix, suffixSize);
+}
+
+template<Escape E, class Stream, class Range>
+void writeEach(Stream & out, const Range & range, const char * prefix, std::size_t prefixSize, const char * suffix, std::size_t suffixSize) {
+	writeRange<E>(out, range, prefix, prefixSize, suffix, suffixSize);
+}
+
+template<Escape E, class Stream, class T, class Allocator>
+void writeEach(Stream & out, const std::vector<T, Allocator> & range, const char * prefix, std::size_t prefixSize, const char * suffix, std::size_t suffixSize) {
+	writeContiguous<E>(out, range.data(), range.size(), prefix, prefixSize, suffix, suffixSize, IsInteger<T>());
+}
+
+template<Escape E, class Stream, class Allocator>
+void writeEach(Stream & out, const std::vector<bool, Allocator> & range, const char * prefix, std::size_t prefixSize, const char * suffix, std::size_t suffixSize) {
+	writeRange<E>(out, range, prefix, prefixSize, suffix, suffixSize);
+}
+
+template<Escape E, class Stream, class T, std::size_t N>
+void writeEach(Stream & out, const std::array<T, N> & range, const char * prefix, std::size_t prefixSize, const char * suffix, std::size_t suffixSize) {
+	writeContiguous<E>(out, range.data(), N, prefix, prefixSize, suffix, suffixSize, IsInteger<T>());
+}
+
+template<Escape E, class Stream, class T, std::size_t N>
+void writeEach(Stream & out, const T (&range)[N], const char * prefix, std::size_t prefixSize, const char * suffix, std::size_t suffixSize) {
+	writeContiguous<E>(out, range, N, prefix, prefixSize, suffix, suffixSize, IsInteger<T>());
+}
+
+}
+
+template<Escape E, class Stream, class Range>
+void writeEach(Stream & out, const Range & range, const char * prefix, std::size_t prefixSize, const char * suffix, std::size_t suffixSize) {
+	bulk::writeEach<E>(out, range, prefix, prefixSize, suffix, suffixSize);
+}
+
+
+// Monotonic bump allocator for per-request allocations. Memory is only given back by reset(), which is O(1)
+// and keeps all blocks for the next request, so a warmed-up arena doesn't touch the heap
+class Arena {
+	struct Block {
+		Block * next;
+		std::size_t size;
+		char * data() { return reinterpret_cast<char *>(this + 1); }
+	};
+
+	Block * first;
+	Block * current;
+	char * ptr;
+	char * end;
+	std::size_t blockSize;
+
+	void use(Block * block) {
+		current = block;
+		ptr = block->data();
+		end = ptr + block->size;
+	}
+
+	// Takes size bytes aligned to alignment from the current block, nullptr if they don't fit. Computed on offsets,
+	// so that neither a pointer past end nor an overflowing one is ever formed
+	char * take(std::size_t size, std::size_t alignment) {
+		if (!ptr) return nullptr;
+		std::size_t padding = (std::size_t)(0 - reinterpret_cast<std::uintptr_t>(ptr)) & (alignment - 1);
+		std::size_t room = (std::size_t)(end - ptr);
+		if ((padding > room) || (size > room - padding)) return nullptr;
+		char * p = ptr + padding;
+		ptr = p + size;
+		return p;
+	}
+
+public:
+	explicit Arena(std::size_t blockSize = 4096) : first(nullptr), current(nullptr), ptr(nullptr), end(nullptr), blockSize(blockSize) {}
+
+	~Arena() {
+		while (first) {
+			Block * next = first->next;
+			::operator delete(first);
+			first = next;
+		}
+	}
+
+	Arena(const Arena &) = delete;
+	Arena & operator=(const Arena &) = delete;
+
+	void * allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t)) {
+		if (char * p = take(size, alignment)) return p;
+
+		// Blocks kept by reset() come first, a new one goes right after the current one
+		while (current && current->next) {
+			use(current->next);
+			if (char * p = take(size, alignment)) return p;
+		}
+
+		if (size > std::size_t(-1) - sizeof(Block) - alignment) throw std::bad_alloc();
+		std::size_t blockDataSize = std::max(blockSize, size + alignment);
+		blockSize *= 2;
+		Block * block = static_cast<Block *>(::operator new(sizeof(Block) + blockDataSize));
+		block->size = blockDataSize;
+		block->next = nullptr;
+		if (current) current->next = block; else first = block;
+		use(block);
+		return take(size, alignment);
+	}
+
+	void reset() {
+		if (first) use(first);
+	}
+};
+
+// std-compatible allocator drawing from an Arena; deallocation is a no-op
+template<class T>
+class ArenaAllocator {
+public:
+	typedef T value_type;
+	Arena * arena;
+
+	explicit ArenaAllocator(Arena & arena) : arena(&arena) {}
+	template<class U> ArenaAllocator(const ArenaAllocator<U> & other) : arena(other.arena) {}
+
+	T * allocate(std::size_t n) {
+		if (n > std::size_t(-1) / sizeof(T)) throw std::bad_alloc();
+		return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+	}
+	void deallocate(T *, std::size_t) {}
+};
+
+template<class T, class U> bool operator==(const ArenaAllocator<T> & a, const ArenaAllocator<U> & b) { return a.arena == b.arena; }
+template<class T, class U> bool operator!=(const ArenaAllocator<T> & a, const ArenaAllocator<U> & b) { return a.arena != b.arena; }
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+
+
+// Writes into a fixed buffer and counts whatever doesn't fit instead of growing
+class FixedBuf : public std::streambuf {
+	std::size_t dropped;
+public:
+	FixedBuf(char * buffer, std::size_t size) : dropped(0) { setp(buffer, buffer + size); }
+
+	std::size_t written() const { return (std::size_t)(pptr() - pbase()); }
+	std::size_t required() const { return written() + dropped; }
+
+protected:
+	int_type overflow(int_type c) override {
+		if (!traits_type::eq_int_type(c, traits_type::eof())) dropped++;
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize xsputn(const char * s, std::streamsize n) override {
+		std::size_t fits = std::min((std::size_t)n, (std::size_t)(epptr() - pptr()));
+		std::memcpy(pptr(), s, fits);
+		pbump((int)fits);
+		dropped += (std::size_t)n - fits;
+		return n;
+	}
+
+	pos_type seekoff(off_type off, std::ios_base::seekdir way, std::ios_base::openmode which) override {
+		if ((off != 0) || (way != std::ios_base::cur) || !(which & std::ios_base::out)) return pos_type(off_type(-1));
+		return pos_type((off_type)required());
+	}
+};
+
+struct RenderResult {
+	std::size_t size;  // bytes written, or the buffer size needed when overflow is set
+	bool overflow;     // the buffer was too small and holds a truncated output
+};
+
+// What TEMPLATE_TO_BUFFER() renders into. Neither the stream nor formatting of strings and numbers allocates
+class FixedStream : public std::ostream {
+	FixedBuf buf;
+public:
+	FixedStream(char * buffer, std::size_t size) : std::ostream(nullptr), buf(buffer, size) { rdbuf(&buf); }
+
+	RenderResult result() const {
+		RenderResult res;
+		res.overflow = buf.required() > buf.written();
+		res.size = buf.required();
+		return res;
+	}
+};
+
+
+namespace profiling {
+
+// Timestamp counter on x86, steady_clock ticks elsewhere
+inline std::uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return (std::uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// One instrumented block or interpolation. htmltpp --profile emits them as function-local statics
+struct Site : Registered<Site> {
+	const char * templateName;
+	unsigned line;
+	const char * kind;
+	std::atomic<std::uint64_t> calls;
+	std::atomic<std::uint64_t> ticks;
+	std::atomic<std::uint64_t> bytes;
+
+	Site(const char * templateName, unsigned line, const char * kind)
+		: templateName(templateName), line(line), kind(kind), calls(0), ticks(0), bytes(0) {}
+};
+
+class Timer {
+	Site & site;
+	std::ostream & out;
+	std::streamoff beginPos;
+	std::uint64_t begin;
+public:
+	Timer(Site & site, std::ostream & out) : site(site), out(out), beginPos(out.tellp()), begin(ticks()) {}
+	~Timer() {
+		std::uint64_t end = ticks();
+		site.calls.fetch_add(1, std::memory_order_relaxed);
+		site.ticks.fetch_add(end - begin, std::memory_order_relaxed);
+		site.bytes.fetch_add((std::uint64_t)(out.tellp() - beginPos), std::memory_order_relaxed);
+	}
+	Timer(const Timer &) = delete;
+	Timer & operator=(const Timer &) = delete;
+};
+
+// Sites aggregated by template and line (every TEMPLATE() call site has its own statics), hottest first.
+// Block timings are inclusive of nested blocks and interpolations
+inline void report(std::ostream & out) {
+	struct Totals { std::uint64_t calls, ticks, bytes; };
+	std::map<std::tuple<std::string, unsigned, std::string>, Totals> totals;
+	for (Site * site = Site::first(); site; site = site->next) {
+		Totals & t = totals[std::make_tuple(std::string(site->templateName), site->line, std::string(site->kind))];
+		t.calls += site->calls.load(std::memory_order_relaxed);
+		t.ticks += site->ticks.load(std::memory_order_relaxed);
+		t.bytes += site->bytes.load(std::memory_order_relaxed);
+	}
+
+	typedef std::pair<std::tuple<std::string, unsigned, std::string>, Totals> Row;
+	std::vector<Row> rows(totals.begin(), totals.end());
+	std::stable_sort(rows.begin(), rows.end(), [](const Row & a, const Row & b) { return a.second.ticks > b.second.ticks; });
+
+	out << "ticks\tcalls\tbytes\tlocation\n";
+	for (const auto & row : rows) {
+		out << row.second.ticks << '\t' << row.second.calls << '\t' << row.second.bytes << '\t'
+		    << std::get<0>(row.first) << ':' << std::get<1>(row.first) << ' ' << std::get<2>(row.first) << '\n';
+	}
+}
+
+inline void reset() {
+	for (Site * site = Site::first(); site; site = site->next) {
+		site->calls.store(0, std::memory_order_relaxed);
+		site->ticks.store(0, std::memory_order_relaxed);
+		site->bytes.store(0, std::memory_order_relaxed);
+	}
+}
+
+}
+
+
+namespace pgo {
+
+// Branch or loop counter emitted by htmltpp --pgo-generate.
+// For $if: executions = evaluations of the condition, taken = times it was true.
+// For $for/$foreach: executions = times the loop was reached, taken = iterations
+struct Counter : Registered<Counter> {
+	const char * templateName;
+	unsigned line;
+	const char * kind;
+	std::atomic<std::uint64_t> executions;
+	std::atomic<std::uint64_t> taken;
+
+	Counter(const char * templateName, unsigned line, const char * kind)
+		: templateName(templateName), line(line), kind(kind), executions(0), taken(0) {}
+
+	void execute() { executions.fetch_add(1, std::memory_order_relaxed); }
+	void take() { taken.fetch_add(1, std::memory_order_relaxed); }
+
+	bool branch(bool condition) {
+		execute();
+		if (condition) take();
+		return condition;
+	}
+};
+
+// Profile for htmltpp --pgo-use, one line per site: template<TAB>line<TAB>executions<TAB>taken<TAB>kind
+inline void writeProfile(std::ostream & out) {
+	std::map<std::tuple<std::string, unsigned, std::string>, std::pair<std::uint64_t, std::uint64_t>> totals;
+	for (Counter * counter = Counter::first(); counter; counter = counter->next) {
+		auto & t = totals[std::make_tuple(std::string(counter->templateName), counter->line, std::string(counter->kind))];
+		t.first += counter->executions.load(std::memory_order_relaxed);
+		t.second += counter->taken.load(std::memory_order_relaxed);
+	}
+	for (const auto & row : totals) {
+		out << std::get<0>(row.first) << '\t' << std::get<1>(row.first) << '\t'
+		    << row.second.first << '\t' << row.second.second << '\t' << std::get<2>(row.first) << '\n';
+	}
+}
+
+inline bool writeProfile(const std::string & fileName) {
+	std::ofstream out(fileName);
+	writeProfile(out);
+	return out.good();
+}
+
+}
+}
+}
@@ -1,42 +1,877 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include <serenity/templater.hpp>
 
 
 #define STATIC_STRING_VARIABLE_NAME "__serenity_templater_str"
 #define RESULT_VARIABLE_NAME "__serenity_templater_res"
 #define MACRO_PREFIX "__SERENITY_TEMPLATER_TEMPLATE_"
+#define OUTPUT_SIZE_FUNCTION_PREFIX "__serenity_templater_output_size_"
+#define STATIC_VIEW_FUNCTION_PREFIX "__serenity_templater_static_"
+#define PROFILING_NAMESPACE "serenity::templater::profiling::"
+#define SITE_VARIABLE_NAME "__serenity_templater_site"
+#define TIMER_VARIABLE_NAME "__serenity_templater_timer"
+#define PGO_NAMESPACE "serenity::templater::pgo::"
+#define SEPARATOR_VARIABLE_NAME "__serenity_templater_separator"
+#define ESCAPE_FUNCTION "serenity::templater::writeEscaped"
+#define STATIC_FUNCTION "serenity::templater::writeStatic"
+#define FLUSH_PREFIX_FUNCTION "serenity::templater::flushPrefix"
+#define AWAIT_QUEUE_VARIABLE_NAME "__serenity_templater_queue"
+#define EACH_FUNCTION "serenity::templater::writeEach"
+#define POOL_FUNCTION_PREFIX "__serenity_templater_pool_"
+#define POOL_PLACEHOLDER_BEGIN "\x01"
+#define POOL_PLACEHOLDER_END "\x02"
+#define RESERVE_FUNCTION "serenity::templater::reserve"
+#define RANGE_SIZE_FUNCTION "serenity::templater::rangeSize"
+#define RANGE_VARIABLE_NAME "__serenity_templater_range"
+#define RUN_FUNCTION "serenity::templater::run"
+#define OPS_VARIABLE_NAME "__serenity_templater_ops"
+#define THUNKS_VARIABLE_NAME "__serenity_templater_thunks"
+#define THUNK_VARIABLE_NAME "__serenity_templater_thunk"
+#define COLD_FUNCTION_BEGIN "[&]()__attribute__((cold,noinline)){"
 
 
 namespace {
 
 int returnCode = 0;
 
-void writeText(std::ostream & out, const std::string & text) {
-	out << "{static const char " STATIC_STRING_VARIABLE_NAME "[]={";
-	out << std::to_string(text[0]);
-	for (auto it = ++text.begin(); it != text.end(); it++) { out << ',' << std::to_string(*it); }
-	out << "};" RESULT_VARIABLE_NAME ".write(" STATIC_STRING_VARIABLE_NAME ",sizeof(" STATIC_STRING_VARIABLE_NAME "));}";
+bool isSpace(char c) { return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r') || (c == '\f'); }
+
+struct Options {
+	bool profile = false;      // --profile: time every block and interpolation
+	bool pgoGenerate = false;  // --pgo-generate: count branches and loop iterations
+	std::string pgoUse;        // --pgo-use=FILE: profile written by serenity::templater::pgo::writeProfile()
+	bool escape = true;        // --no-escape: write interpolated strings as is
+	bool minify = false;       // --minify: strip comments and collapse whitespace in static text
+	bool incbin = false;       // --incbin: static text in a binary file next to the output, see StringPool::writeIncbin()
+	std::vector<std::string> disabledPasses;  // --disable-pass=NAME
+	std::string backend = "auto";             // --backend=auto|inline|table
+	std::string cache;                        // --cache=DIR: generated code of each template by content hash
+	std::string depFile;                      // -MD, -MF FILE: make rule listing what the output depends on
+	std::vector<std::string> depTargets;      // -MT TARGET: targets of that rule instead of the output files
+};
+
+Options options;
+
+struct Block {
+	int wrappers = 0;       // scopes opened around the block by instrumentation, closed by $end
+	bool coldBody = false;  // $if/$for/$foreach body is outlined into a cold function
+	bool coldElse = false;  // $else body is outlined into a cold function
+};
+
+// Follows JavaScript in <script> elements and event handler attributes: string and template literals, comments and
+// regular expressions, so that an interpolation is escaped as a string, quoted as a value in code, or rejected where
+// neither keeps it in place
+class JsScanner {
+	enum class State {
+		CODE,
+		STRING,         // '...' or "..."
+		TEMPLATE,       // `...`, outside of ${...}
+		LINE_COMMENT,   // // ...
+		BLOCK_COMMENT,  // /* ... */
+		REGEX,          // /.../
+		REGEX_CLASS     // [...] in a regular expression, where / doesn't end it
+	};
+
+	State state = State::CODE;
+	char quote = 0;
+	bool backslash = false;
+	bool slash = false;        // a / in code, which the next character makes a comment, a regular expression or a division
+	char previous = 0;         // previous character, for ${ and */
+	char last = 0;             // last character of code that isn't whitespace
+	std::string word;          // identifier or keyword that ends at last
+	std::vector<int> braces;   // per ${...} of the template literals around, { opened in it
+
+	static bool isWordChar(char c) { return isalnum((unsigned char)c) || (c == '_') || (c == '$') || ((unsigned char)c >= 0x80); }
+
+	// Whether a / after last starts a regular expression rather than dividing a value. After ) and ] it divides, a
+	// guess that fits `if (x) /re/.test(s)` wrongly but real code rarely
+	bool regexAllowed() const {
+		static const char * const keywords[] = { "return", "typeof", "instanceof", "in", "of", "new", "delete", "void", "throw",
+		                                         "case", "do", "else", "yield", "await" };
+		if (isWordChar(last)) return std::find(std::begin(keywords), std::end(keywords), word) != std::end(keywords);
+		return (last != ')') && (last != ']') && (last != '"') && (last != '\'') && (last != '`');
+	}
+
+	void code(char c) {
+		if (slash) {
+			slash = false;
+			if (c == '/') { state = State::LINE_COMMENT; return; }
+			if (c == '*') { state = State::BLOCK_COMMENT; previous = 0; return; }
+			if (regexAllowed()) { state = State::REGEX; feed(c); return; }
+			last = '/';
+			word.clear();
+		}
+		if (c == '/') { slash = true; return; }
+		if ((c == '"') || (c == '\'')) { state = State::STRING; quote = c; } else
+		if (c == '`') { state = State::TEMPLATE; previous = 0; } else
+		if ((c == '{') && !braces.empty()) { braces.back()++; } else
+		if ((c == '}') && !braces.empty()) {
+			if (braces.back() == 0) { braces.pop_back(); state = State::TEMPLATE; previous = 0; return; }  // end of ${...}
+			braces.back()--;
+		}
+		if (isSpace(c)) return;
+		if (isWordChar(c)) { if (!isWordChar(last)) word.clear(); word += c; } else { word.clear(); }
+		last = c;
+	}
+
+public:
+	void feed(char c) {
+		switch (state) {
+			case State::CODE:
+				code(c);
+				break;
+			case State::STRING:
+				if (backslash) { backslash = false; } else
+				if (c == '\\') { backslash = true; } else
+				if (c == quote) { state = State::CODE; last = c; }
+				break;
+			case State::TEMPLATE:
+				if (backslash) { backslash = false; c = 0; } else  // \${ is text
+				if (c == '\\') { backslash = true; } else
+				if (c == '`') { state = State::CODE; last = c; } else
+				if ((c == '{') && (previous == '$')) { state = State::CODE; braces.push_back(0); last = c; word.clear(); }
+				previous = c;
+				break;
+			case State::LINE_COMMENT:
+				if ((c == '\n') || (c == '\r')) state = State::CODE;
+				break;
+			case State::BLOCK_COMMENT:
+				if ((c == '/') && (previous == '*')) state = State::CODE;
+				previous = c;
+				break;
+			case State::REGEX:
+			case State::REGEX_CLASS:
+				if (backslash) { backslash = false; } else
+				if (c == '\\') { backslash = true; } else
+				if (c == '[') { state = State::REGEX_CLASS; } else
+				if (c == ']') { state = State::REGEX; } else
+				if ((c == '/') && (state == State::REGEX)) { state = State::CODE; last = ')'; }  // flags follow, then / divides
+				break;
+		}
+	}
+
+	// An interpolated value in code is an operand, after which / divides
+	void interpolate() {
+		if (state != State::CODE) return;
+		slash = false;
+		last = ')';
+	}
+
+	// Escaping of the next interpolation, valueEscape in code, or nullptr in comments and regular expressions
+	const char * escape(const char * valueEscape) const {
+		switch (state) {
+			case State::CODE:
+				return (slash && regexAllowed()) ? nullptr : valueEscape;
+			case State::STRING:
+			case State::TEMPLATE:
+				return "JsString";
+			default:
+				return nullptr;
+		}
+	}
+};
+
+// Follows the HTML written by static text so far to find out where the next interpolation lands.
+// Interpolated values are assumed not to change the state, other than starting an unquoted attribute value
+class HtmlScanner {
+	enum class State {
+		TEXT,
+		TAG_NAME,                      // <tag
+		TAG,                           // <tag ... between attributes
+		ATTRIBUTE_NAME,                // <tag name
+		AFTER_ATTRIBUTE_NAME,          // <tag name ...
+		BEFORE_ATTRIBUTE_VALUE,        // <tag name=
+		ATTRIBUTE_VALUE_DOUBLE_QUOTED, // <tag name="
+		ATTRIBUTE_VALUE_SINGLE_QUOTED, // <tag name='
+		ATTRIBUTE_VALUE_UNQUOTED,      // <tag name=v
+		COMMENT,                       // <!-- ... -->
+		RAW_TEXT                       // <script> or <style> content
+	};
+
+	State state = State::TEXT;
+	std::string tagName;
+	std::string attributeName;
+	std::string rawTextTag;  // script or style
+	int preformatted = 0;    // depth of open <pre> and <textarea> elements
+	bool closingTag = false;
+	bool valueStart = false; // nothing of the attribute value written yet
+	JsScanner js;            // <script> content or an on* attribute value
+	std::string reference;   // character reference in an on* attribute value, after the &
+	bool inReference = false;
+	bool unknownReference = false;  // an on* attribute value has a reference not decoded here, what follows is unknown
+	std::string tail;        // last characters, lowercased, to find "-->" and "</script"
+
+	bool tailIs(const std::string & s) const {
+		return (tail.size() >= s.size()) && (tail.compare(tail.size() - s.size(), s.size(), s) == 0);
+	}
+
+	void endTag() {
+		if ((tagName == "pre") || (tagName == "textarea")) preformatted += closingTag ? (preformatted > 0 ? -1 : 0) : 1;
+		if (!closingTag && ((tagName == "script") || (tagName == "style"))) {
+			state = State::RAW_TEXT;
+			rawTextTag = tagName;
+			js = JsScanner();
+		} else {
+			state = State::TEXT;
+		}
+	}
+
+	void startTag() {
+		state = State::TAG_NAME;
+		tagName.clear();
+		closingTag = false;
+	}
+
+	bool handler() const { return attributeName.compare(0, 2, "on") == 0; }
+
+	void startValue(State quoted) {
+		state = quoted;
+		js = JsScanner();
+		inReference = false;
+		unknownReference = false;
+	}
+
+	// Event handler code is what the HTML parser decodes from the value, where quotes can come as &quot; and the like.
+	// References other than the numeric ones and a few named ones make the rest of the value unknown
+	void feedHandler(char c) {
+		if (!inReference) {
+			if (c == '&') { inReference = true; reference.clear(); } else js.feed(c);
+			return;
+		}
+		if (isalnum((unsigned char)c) || ((c == '#') && reference.empty())) { reference += c; return; }
+		inReference = false;
+		if (reference.empty()) { js.feed('&'); feedHandler(c); return; }
+		char decoded = 0;
+		if (reference[0] == '#') {
+			bool hex = (reference.size() > 1) && ((reference[1] | 0x20) == 'x');
+			unsigned long code = std::strtoul(reference.c_str() + (hex ? 2 : 1), nullptr, hex ? 16 : 10);
+			decoded = ((code > 0) && (code < 0x80)) ? (char)code : 'x';
+		} else if (c == ';') {
+			static const std::map<std::string, char> named = { { "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' } };
+			auto it = named.find(reference);
+			if (it != named.end()) decoded = it->second;
+		}
+		if (decoded) js.feed(decoded); else unknownReference = true;
+		if (c != ';') feedHandler(c);
+	}
+
+public:
+	void feed(char c) {
+		char lower = (char)tolower(c);
+		tail += lower;
+		if (tail.size() > 16) tail.erase(0, tail.size() - 16);
+
+		switch (state) {
+			case State::TEXT:
+				if (c == '<') startTag();
+				break;
+			case State::TAG_NAME:
+				if (tagName.empty() && !closingTag && (c == '/')) { closingTag = true; } else
+				if (isalnum(c) || (c == '-') || (c == '!')) {
+					tagName += lower;
+					if (tagName == "!--") state = State::COMMENT;
+				} else
+				if (tagName.empty()) { state = State::TEXT; } else  // "a < b" is text
+				if (c == '>') { endTag(); } else
+				if (isSpace(c) || (c == '/')) { state = State::TAG; }
+				break;
+			case State::TAG:
+				if (c == '>') { endTag(); } else
+				if (!isSpace(c) && (c != '/')) { state = State::ATTRIBUTE_NAME; attributeName = lower; }
+				break;
+			case State::ATTRIBUTE_NAME:
+				if (c == '=') { state = State::BEFORE_ATTRIBUTE_VALUE; } else
+				if (c == '>') { endTag(); } else
+				if (isSpace(c)) { state = State::AFTER_ATTRIBUTE_NAME; } else
+				if (c == '/') { state = State::TAG; } else { attributeName += lower; }
+				break;
+			case State::AFTER_ATTRIBUTE_NAME:
+				if (c == '=') { state = State::BEFORE_ATTRIBUTE_VALUE; } else
+				if (c == '>') { endTag(); } else
+				if (c == '/') { state = State::TAG; } else
+				if (!isSpace(c)) { state = State::ATTRIBUTE_NAME; attributeName = lower; }
+				break;
+			case State::BEFORE_ATTRIBUTE_VALUE:
+				valueStart = true;
+				if (c == '"') { startValue(State::ATTRIBUTE_VALUE_DOUBLE_QUOTED); } else
+				if (c == '\'') { startValue(State::ATTRIBUTE_VALUE_SINGLE_QUOTED); } else
+				if (c == '>') { endTag(); } else
+				if (!isSpace(c)) { state = State::ATTRIBUTE_VALUE_UNQUOTED; valueStart = false; }
+				break;
+			case State::ATTRIBUTE_VALUE_DOUBLE_QUOTED:
+			case State::ATTRIBUTE_VALUE_SINGLE_QUOTED:
+				if (c == ((state == State::ATTRIBUTE_VALUE_DOUBLE_QUOTED) ? '"' : '\'')) { state = State::TAG; break; }
+				valueStart = false;
+				if (handler()) feedHandler(c);
+				break;
+			case State::ATTRIBUTE_VALUE_UNQUOTED:
+				if (isSpace(c)) { state = State::TAG; } else
+				if (c == '>') { endTag(); }
+				break;
+			case State::COMMENT:
+				if (tailIs("-->")) state = State::TEXT;
+				break;
+			case State::RAW_TEXT:
+				if (rawTextTag == "script") js.feed(c);
+				break;
+		}
+
+		// The HTML parser ends <script> and <style> on their end tag, even inside a string literal or a comment
+		if ((state == State::RAW_TEXT) && tailIs("</" + rawTextTag)) {
+			state = State::TAG_NAME;
+			tagName = rawTextTag;
+			closingTag = true;
+		}
+	}
+
+	void feed(const std::string & text) { for (char c : text) feed(c); }
+
+	// After an interpolation: <p title=$x is inside the value, as long as x isn't empty
+	void interpolate() {
+		if (state == State::BEFORE_ATTRIBUTE_VALUE) state = State::ATTRIBUTE_VALUE_UNQUOTED;
+		valueStart = false;
+		js.interpolate();
+	}
+
+	// Whitespace can be collapsed: text outside <pre>, <textarea>, <script> and <style>, or between attributes
+	bool inText() const { return (state == State::TEXT) && (preformatted == 0); }
+	bool betweenAttributes() const {
+		return ((state == State::TAG_NAME) && !tagName.empty()) ||
+		       (state == State::TAG) || (state == State::AFTER_ATTRIBUTE_NAME) || (state == State::BEFORE_ATTRIBUTE_VALUE);
+	}
+
+	// Escaping of the next interpolation, a serenity::templater::Escape value, or nullptr where no escaping
+	// keeps a value in its place
+	const char * escape() const {
+		bool url = (attributeName == "href") || (attributeName == "xlink:href") || (attributeName == "src") || (attributeName == "action") ||
+		           (attributeName == "formaction") || (attributeName == "cite") || (attributeName == "poster") || (attributeName == "background") ||
+		           (attributeName == "ping") || (attributeName == "codebase") || (attributeName == "longdesc") || (attributeName == "manifest") ||
+		           (attributeName == "icon") || ((attributeName == "data") && (tagName == "object"));
+		switch (state) {
+			case State::TEXT:
+			case State::COMMENT:
+				return "HtmlText";
+			case State::ATTRIBUTE_VALUE_DOUBLE_QUOTED:
+			case State::ATTRIBUTE_VALUE_SINGLE_QUOTED:
+				if (handler()) return (unknownReference || inReference) ? nullptr : js.escape("JsAttributeValue");
+				if (url) return valueStart ? "Url" : "UrlComponent";
+				if (attributeName == "style") return "Css";
+				return "HtmlAttribute";
+			case State::BEFORE_ATTRIBUTE_VALUE:
+			case State::ATTRIBUTE_VALUE_UNQUOTED:
+				// Whitespace ends the value, and script and CSS can't do without it
+				if (handler() || (attributeName == "style")) return nullptr;
+				if (url) return (state == State::BEFORE_ATTRIBUTE_VALUE) ? "Url" : "UrlComponent";  // percent-encode whitespace
+				return "HtmlUnquotedAttribute";
+			case State::RAW_TEXT:
+				return (rawTextTag == "script") ? js.escape("JsValue") : "Css";
+			default:
+				// Between attributes or in a name: stays one name
+				return "HtmlUnquotedAttribute";
+		}
+	}
+};
+
+// Same for .jsont templates: an interpolation is either a whole JSON value or a part of a string literal
+class JsonScanner {
+	bool inString_ = false;
+	bool backslash = false;
+	char last = 0;  // last character outside of strings and whitespace, 'v' for an interpolated value
+public:
+	void feed(char c) {
+		if (backslash) { backslash = false; } else
+		if (inString_ && (c == '\\')) { backslash = true; } else
+		if (c == '"') { inString_ = !inString_; }
+		if (!inString_ && !isSpace(c)) last = c;
+	}
+
+	void feed(const std::string & text) { for (char c : text) feed(c); }
+
+	void interpolate() { if (!inString_) last = 'v'; }
+
+	bool inString() const { return inString_; }
+
+	// Where an element of an array or a member of an object starts
+	bool inList() const { return !inString_ && ((last == '[') || (last == '{') || (last == ',')); }
+
+	const char * escape() const { return inString_ ? "JsonString" : "JsonValue"; }
+};
+
+struct Template {
+	std::string name;
+	bool json = false;  // .jsont: JSON escaping and separators between loop iterations
+	HtmlScanner html;
+	JsonScanner jsonScanner;
+	int sites = 0;              // instrumentation sites emitted so far, used to give them unique names
+	int awaits = 0;             // $await blocks so far
+	std::vector<std::string> separators;  // .jsont loops whose comma waits for the first write of the iteration, see writeBlock()
+	bool inPrefix = true;       // no command written yet
+	bool prefixText = false;    // static text written before the first command
+	std::vector<std::string> strings;                   // static text in the string pool, see poolOffset()
+	std::map<std::string, std::size_t> stringIndexes;  // index of each one in strings
+};
+
+struct ProfileEntry {
+	unsigned long long executions = 0;
+	unsigned long long taken = 0;
+};
+
+// "template\tline\tkind" -> counters
+std::map<std::string, ProfileEntry> profile;
+
+std::string profileKey(const std::string & templateName, int line, const std::string & kind) {
+	return templateName + '\t' + std::to_string(line) + '\t' + kind;
 }
 
-void writeCommand(std::ostream & out, const std::string & command, const std::string & parameters) {
-	if ((command == "") && (parameters == "")) return;
+void readProfile(const std::string & fileName) {
+	std::ifstream in(fileName);
+	if (!in) {
+		std::cout << "can't read profile '" << fileName << "'\n";
+		returnCode = 1;
+		return;
+	}
+	std::string templateName, line, kind;
+	ProfileEntry entry;
+	while (std::getline(in, templateName, '\t') && std::getline(in, line, '\t') && (in >> entry.executions >> entry.taken) && (in.get() == '\t') && std::getline(in, kind)) {
+		profile[templateName + '\t' + line + '\t' + kind] = entry;
+	}
+}
 
-	if (command == "")        out << RESULT_VARIABLE_NAME "<<" << parameters << ";"; else  // $(var)
-	if (command == "else")    out << "}else{"; else  // $else
-	if (command == "end")     out << "}"; else       // $end
-	if (parameters == "")     out << RESULT_VARIABLE_NAME "<<" << command << ";"; else  // $var
-	if (command == "for")     out << "for(" << parameters << "){"; else        // $for (int i=0; i<n; i++)
-	if (command == "foreach") out << "for(auto&&" << parameters << "){"; else  // $foreach(item : collection)
-	if (command == "if")      out << "if(" << parameters << "){"; else {       // $if (cond)
-		std::cout << "unknown command: $'" << command << "'('" << parameters << "')";
+// Empty if the file can't be read
+std::string readFile(const std::string & fileName) {
+	std::ifstream in(fileName, std::ios::in | std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void writeIfChanged(const std::string & fileName, const std::string & content) {
+	if ((readFile(fileName) == content) && std::ifstream(fileName)) return;
+	std::ofstream out(fileName, std::ios::out | std::ios::binary);
+	out << content;
+	if (!out) {
+		std::cout << "can't write " << fileName << "\n";
 		returnCode = 1;
 	}
 }
 
-void preprocess(std::istream & in, std::ostream & out, const std::string & templateName) {
-	out << "#define " MACRO_PREFIX << templateName << " [&](){std::stringstream " RESULT_VARIABLE_NAME ";";
+std::string cStringLiteral(const std::string & s) {
+	std::string res = "\"";
+	for (char c : s) {
+		if ((c == '"') || (c == '\\')) { res += '\\'; res += c; } else
+		if (c == '\n') { res += "\\n"; } else
+		if (c == '\t') { res += "\\t"; } else { res += c; }
+	}
+	return res + '"';
+}
+
+// How a command shows up in the profiling report and in the PGO profile
+std::string describeCommand(const std::string & command, const std::string & parameters) {
+	std::string res = "$" + command + (command.empty() || (parameters != "") ? "(" + parameters + ")" : "");
+	for (char & c : res) { if ((c == '\n') || (c == '\t') || (c == '\r')) c = ' '; }
+	return res;
+}
+
+void writeProfilingTimer(std::ostream & out, Template & t, int line, const std::string & kind) {
+	int n = t.sites++;
+	out << "static " PROFILING_NAMESPACE "Site " SITE_VARIABLE_NAME << n << "(" << cStringLiteral(t.name) << "," << line << "," << cStringLiteral(kind) << ");";
+	out << PROFILING_NAMESPACE "Timer " TIMER_VARIABLE_NAME << n << "(" SITE_VARIABLE_NAME << n << "," RESULT_VARIABLE_NAME ");";
+}
+
+// Declares a PGO counter and returns its name
+std::string writePgoCounter(std::ostream & out, Template & t, int line, const std::string & kind) {
+	std::string name = SITE_VARIABLE_NAME + std::to_string(t.sites++);
+	out << "static " PGO_NAMESPACE "Counter " << name << "(" << cStringLiteral(t.name) << "," << line << "," << cStringLiteral(kind) << ");";
+	return name;
+}
+
+// Every template line becomes one physical line of the macro, so that after '#line 1 "file.htmlt"'
+// compiler diagnostics point at template lines. Only diagnostics: the template is a macro expanded in the caller
+// (its expressions use the caller's variables), so debug line info and profilers see the TEMPLATE() line; --profile
+// times template lines instead
+std::string continueLines(const std::string & code) {
+	std::string res;
+	for (char c : code) { if (c == '\n') res += "\\\n"; else res += c; }
+	return res;
+}
+
+// Lowercase name of the tag starting at s[lt], "!" and "!--" included, without the / of an end tag
+std::string tagName(const std::string & s, size_t lt) {
+	size_t i = lt + 1;
+	if ((i < s.size()) && (s[i] == '/')) i++;
+	std::string res;
+	for (; (i < s.size()) && (isalnum((unsigned char)s[i]) || (s[i] == '!') || (s[i] == '-')); i++) res += (char)tolower((unsigned char)s[i]);
+	return res;
+}
+
+// Whitespace next to these isn't rendered: block-level elements, elements that aren't displayed, doctype and comments
+bool isBlockTag(const std::string & name) {
+	static const std::string names = " html head body title meta link base script style noscript template div p ul ol li dl dt dd "
+		"table caption colgroup col thead tbody tfoot tr td th form fieldset legend h1 h2 h3 h4 h5 h6 header footer nav section article aside "
+		"main figure figcaption blockquote pre hr address details summary dialog menu option optgroup ";
+	return !name.empty() && ((name[0] == '!') || (names.find(" " + name + " ") != std::string::npos));
+}
+
+// --minify for HTML: drops comments (except <!--[if ...]> ones) and line breaks next to block-level tags,
+// collapses other whitespace runs to one character. <pre>, <textarea>, <script> and <style> are left alone.
+// Comments and whitespace that cross an interpolation are only collapsed up to it
+std::string minifyHtml(const std::string & text, HtmlScanner & html) {
+	std::string res;
+	for (size_t i = 0; i < text.size();) {
+		char c = text[i];
+		if (html.inText() && (text.compare(i, 4, "<!--") == 0) && (text.compare(i, 5, "<!--[") != 0)) {
+			size_t end = text.find("-->", i + 4);
+			if (end != std::string::npos) {
+				end += 3;
+				html.feed(text.substr(i, end - i));
+				i = end;
+				continue;
+			}
+		}
+		if (isSpace(c) && (html.inText() || html.betweenAttributes())) {
+			size_t end = i;
+			while ((end < text.size()) && isSpace(text[end])) end++;
+			bool newline = text.find('\n', i) < end;
+			bool betweenTags = html.inText() && newline && !res.empty() && (res.back() == '>') && (end < text.size()) && (text[end] == '<');
+			size_t previousTag = res.rfind('<');
+			bool blockTag = betweenTags && (((previousTag != std::string::npos) && isBlockTag(tagName(res, previousTag))) || isBlockTag(tagName(text, end)));
+			if (!blockTag) res += newline ? '\n' : ' ';
+			html.feed(text.substr(i, end - i));
+			i = end;
+			continue;
+		}
+		html.feed(c);
+		res += c;
+		i++;
+	}
+	return res;
+}
+
+// --minify for JSON: whitespace outside of string literals goes away
+std::string minifyJson(const std::string & text, JsonScanner & json) {
+	std::string res;
+	for (char c : text) {
+		if (!isSpace(c) || json.inString()) res += c;
+		json.feed(c);
+	}
+	return res;
+}
+
+void writeStaticArray(std::ostream & out, const char * name, const std::string & text) {
+	out << "static const char " << name << "[]={";
+	for (auto it = text.begin(); it != text.end(); it++) {
+		if (it != text.begin()) out << ',';
+		out << std::to_string(*it);
+	}
+	out << "};";
+}
+
+// Static text of all templates of one output file, in one array returned by an inline function, so that the program
+// has one copy of it. Every distinct string is stored once, and a string that ends another one is that one's tail
+struct StringPool {
+	std::string function;  // name of the function returning the array
+	std::string data;
+	std::map<std::string, std::size_t> offsets;
+
+	void add(const std::string & s) {
+		if (!s.empty()) offsets[s] = 0;
+	}
+
+	// Sorted by their reversed text, strings come right before the strings they end, if any. Placing them from the
+	// last, each one is either the tail of the string placed last or new
+	void build() {
+		std::vector<std::string> reversed;
+		for (auto & entry : offsets) reversed.push_back(std::string(entry.first.rbegin(), entry.first.rend()));
+		std::sort(reversed.begin(), reversed.end());
+		std::string last;
+		std::size_t lastOffset = 0;
+		for (auto it = reversed.rbegin(); it != reversed.rend(); ++it) {
+			bool isTail = (last.size() >= it->size()) && (last.compare(0, it->size(), *it) == 0);
+			if (!isTail) {
+				last = *it;
+				lastOffset = data.size();
+				data.append(it->rbegin(), it->rend());
+			}
+			offsets[std::string(it->rbegin(), it->rend())] = lastOffset + last.size() - it->size();
+		}
+	}
+
+	void write(std::ostream & out) const {
+		if (data.empty()) return;
+		out << "inline const char * " << function << "(){";
+		writeStaticArray(out, STATIC_STRING_VARIABLE_NAME, data);
+		out << "return " STATIC_STRING_VARIABLE_NAME ";}\n";
+	}
+
+	// The pool as a file the assembler includes with .incbin, instead of an array the C++ front end parses byte by byte.
+	// The symbol is in a COMDAT group, so the output file can be included in many translation units like the array.
+	// The assembler gets the absolute path, so that the output file can be compiled from any directory
+	void writeIncbin(std::ostream & out, const std::string & binFileName) const {
+		if (data.empty()) return;
+		writeIfChanged(binFileName, data);
+
+		std::string path = binFileName;
+		if (char * resolved = realpath(binFileName.c_str(), nullptr)) {
+			path = resolved;
+			free(resolved);
+		}
+		std::string escapedPath;
+		for (char c : path) {
+			if (c == '"' || c == '\\') escapedPath += '\\';
+			escapedPath += c;
+		}
+
+		std::string symbol = function + "_data";
+		std::string section = ".rodata." + symbol;
+		out << "#if !defined(__ELF__) || !defined(__GNUC__)\n#error \"htmltpp --incbin output needs an ELF target and a GNU-compatible assembler\"\n#endif\n";
+		out << "extern \"C\" const char " << symbol << "[];\n";
+		out << "__asm__(" << cStringLiteral(".pushsection " + section + ",\"aG\",@progbits," + symbol + ",comdat\n") << "\n";
+		out << "\t" << cStringLiteral(".weak " + symbol + "\n.hidden " + symbol + "\n" + symbol + ":\n") << "\n";
+		out << "\t" << cStringLiteral(".incbin \"" + escapedPath + "\"\n.popsection\n") << ");\n";
+		out << "inline const char * " << function << "(){return " << symbol << ";}\n";
+	}
+};
+
+StringPool pool;
+
+// Offset of text in the pool, which is laid out once all templates are generated. Until then generated code holds
+// placeholders, POOL_PLACEHOLDER_BEGIN index in t.strings POOL_PLACEHOLDER_END, see resolvePool()
+std::string poolOffset(Template & t, const std::string & text) {
+	auto it = t.stringIndexes.find(text);
+	if (it == t.stringIndexes.end()) {
+		it = t.stringIndexes.insert(std::make_pair(text, t.strings.size())).first;
+		t.strings.push_back(text);
+	}
+	return POOL_PLACEHOLDER_BEGIN + std::to_string(it->second) + POOL_PLACEHOLDER_END;
+}
+
+// Pointer and size arguments for text
+std::string poolReference(Template & t, const std::string & text) {
+	return pool.function + "()+" + poolOffset(t, text) + "," + std::to_string(text.size());
+}
+
+std::string resolvePool(const std::string & code, const std::vector<std::string> & strings) {
+	std::string res;
+	res.reserve(code.size());
+	std::size_t done = 0;
+	for (std::size_t begin = code.find(POOL_PLACEHOLDER_BEGIN); begin != std::string::npos; begin = code.find(POOL_PLACEHOLDER_BEGIN, done)) {
+		std::size_t end = code.find(POOL_PLACEHOLDER_END, begin);
+		res.append(code, done, begin - done);
+		res += std::to_string(pool.offsets.at(strings.at(std::stoul(code.substr(begin + 1, end - begin - 1)))));
+		done = end + 1;
+	}
+	res.append(code, done, std::string::npos);
+	return res;
+}
+
+void writeText(std::ostream & out, Template & t, const std::string & text) {
+	out << STATIC_FUNCTION "(" RESULT_VARIABLE_NAME "," << poolReference(t, text) << ");";
+}
+
+// Splits "expr:spec" from $(expr:spec) into the expression and a call of the formatter specialized for spec.
+// spec is [0][width][.precision]type, type is one of d x X o f %. "a::b" and "c ? a : b" are not specs
+bool parseFormatSpec(const std::string & parameters, std::string & expression, std::string & formatter) {
+	int depth = 0;
+	size_t colon = std::string::npos;
+	char quote = 0;
+	for (size_t i = 0; i < parameters.size(); i++) {
+		char c = parameters[i];
+		if (quote) {
+			if (c == '\\') i++; else if (c == quote) quote = 0;
+			continue;
+		}
+		if ((c == '"') || (c == '\'')) quote = c; else
+		if ((c == '(') || (c == '[') || (c == '{')) depth++; else
+		if ((c == ')') || (c == ']') || (c == '}')) depth--; else
+		if ((c == '?') && (depth == 0)) return false; else
+		if ((c == ':') && (depth == 0)) {
+			bool scope = ((i > 0) && (parameters[i-1] == ':')) || ((i+1 < parameters.size()) && (parameters[i+1] == ':'));
+			if (!scope) colon = i;
+		}
+	}
+	if (colon == std::string::npos) return false;
+
+	std::string spec = parameters.substr(colon + 1);
+	spec.erase(0, spec.find_first_not_of(" \t"));
+	spec.erase(spec.find_last_not_of(" \t") + 1);
+	if (spec.empty()) return false;
+
+	size_t i = 0;
+	bool zeroFill = (spec[i] == '0');
+	if (zeroFill) i++;
+	int width = 0, precision = -1;
+	for (; (i < spec.size()) && isdigit(spec[i]); i++) width = width * 10 + (spec[i] - '0');
+	if ((i < spec.size()) && (spec[i] == '.')) {
+		if ((++i == spec.size()) || !isdigit(spec[i])) return false;
+		for (precision = 0; (i < spec.size()) && isdigit(spec[i]); i++) precision = precision * 10 + (spec[i] - '0');
+	}
+	if ((i + 1 != spec.size()) || (std::string("dxXof%").find(spec[i]) == std::string::npos)) return false;
+
+	expression = parameters.substr(0, colon);
+	formatter = "serenity::templater::writeFormatted<'" + std::string(1, spec[i]) + "'," + std::to_string(width) + "," +
+	            std::to_string(precision) + "," + (zeroFill ? "true" : "false") + ">";
+	return true;
+}
+
+std::string trim(const std::string & s) {
+	std::size_t begin = 0, end = s.size();
+	while ((begin < end) && isSpace(s[begin])) begin++;
+	while ((end > begin) && isSpace(s[end - 1])) end--;
+	return s.substr(begin, end - begin);
+}
+
+bool isIdentifier(const std::string & s) {
+	if (s.empty() || isdigit((unsigned char)s[0])) return false;
+	for (char c : s) { if (!isalnum((unsigned char)c) && (c != '_')) return false; }
+	return true;
+}
+
+// $foreach(n : {1, 2, 3}): a braced list is a range of a range-based for, but not an expression
+bool isBracedList(const std::string & range) {
+	std::string s = trim(range);
+	return !s.empty() && (s[0] == '{');
+}
+
+// A range as the initializer of a variable, in parentheses unless it's a braced list, so that a comma stays in it
+std::string rangeInitializer(const std::string & range) {
+	return isBracedList(range) ? range : "(" + range + ")";
+}
+
+// Position of the ':' in "name : expression", skipping "::"
+std::size_t findColon(const std::string & parameters) {
+	for (std::size_t i = 0; i < parameters.size(); i++) {
+		if (parameters[i] != ':') continue;
+		if ((i + 1 < parameters.size()) && (parameters[i + 1] == ':')) { i++; continue; }
+		return i;
+	}
+	return std::string::npos;
+}
+
+// Value of a literal as writeEscaped() would write it before escaping: "string" and 'c' (kind 's'),
+// decimal integers (kind 'n') and true/false (kind 'b'). False for anything else
+bool parseLiteral(const std::string & expression, std::string & value, char & kind) {
+	value.clear();
+	if (expression == "true" || expression == "false") {
+		value = expression;
+		kind = 'b';
+		return true;
+	}
+	std::size_t i = (!expression.empty() && (expression[0] == '-')) ? 1 : 0;
+	std::size_t digits = expression.size() - i;
+	if ((digits > 0) && (digits <= 18) && std::all_of(expression.begin() + (long)i, expression.end(), [](char c) { return isdigit((unsigned char)c); })) {
+		if ((expression[i] == '0') && (digits > 1)) return false;  // octal
+		value = (expression == "-0") ? "0" : expression;
+		kind = 'n';
+		return true;
+	}
 
+	if ((expression.size() < 2) || ((expression[0] != '"') && (expression[0] != '\'')) || (expression.back() != expression[0])) return false;
+	for (std::size_t j = 1; j + 1 < expression.size(); j++) {
+		char c = expression[j];
+		if (c == expression[0]) return false;  // "a" "b", or not a literal at all
+		if (c == '\\') {
+			if (++j + 1 >= expression.size()) return false;
+			switch (expression[j]) {
+				case '"': case '\'': case '\\': c = expression[j]; break;
+				case 'n': c = '\n'; break;
+				case 't': c = '\t'; break;
+				case 'r': c = '\r'; break;
+				default: return false;
+			}
+		}
+		value += c;
+	}
+	kind = 's';
+	return (expression[0] == '"') || (value.size() == 1);
+}
+
+// What serenity::templater::writeEscaped<E>() writes for a literal, computed by the runtime itself
+template<serenity::templater::Escape E>
+std::string escapeLiteral(const std::string & value, char kind) {
+	std::ostringstream out;
+	if (kind == 'b') serenity::templater::writeEscaped<E>(out, value == "true"); else
+	if (kind == 'n') serenity::templater::writeEscaped<E>(out, std::stoll(value)); else
+	serenity::templater::writeEscaped<E>(out, value);
+	return out.str();
+}
+
+// By serenity::templater::Escape value name, as the scanners give them
+const std::map<std::string, std::string (*)(const std::string &, char)> literalEscapes = {
+	{ "HtmlText", escapeLiteral<serenity::templater::Escape::HtmlText> },
+	{ "HtmlAttribute", escapeLiteral<serenity::templater::Escape::HtmlAttribute> },
+	{ "HtmlUnquotedAttribute", escapeLiteral<serenity::templater::Escape::HtmlUnquotedAttribute> },
+	{ "JsString", escapeLiteral<serenity::templater::Escape::JsString> },
+	{ "JsValue", escapeLiteral<serenity::templater::Escape::JsValue> },
+	{ "JsAttributeValue", escapeLiteral<serenity::templater::Escape::JsAttributeValue> },
+	{ "Css", escapeLiteral<serenity::templater::Escape::Css> },
+	{ "Url", escapeLiteral<serenity::templater::Escape::Url> },
+	{ "UrlComponent", escapeLiteral<serenity::templater::Escape::UrlComponent> },
+	{ "JsonValue", escapeLiteral<serenity::templater::Escape::JsonValue> },
+	{ "JsonString", escapeLiteral<serenity::templater::Escape::JsonString> },
+};
+
+// What a literal interpolation writes, escaped for escape; escape is null for $raw and --no-escape, written with operator<<
+std::string escapeConstant(const std::string & value, char kind, const char * escape) {
+	if (!escape) return (kind == 'b') ? ((value == "true") ? "1" : "0") : value;
+	return literalEscapes.at(escape)(value, kind);
+}
+
+// Static text followed by a command, what the lexer splits a template into
+struct Segment {
+	std::string text;
+	std::string command;
+	std::string parameters;
+	int commandLine = 1;
+};
+
+// Template IR: static text, interpolations and blocks with their bodies, in template order
+struct Node {
+	enum class Kind {
+		TEXT,   // static text
+		EMIT,   // $x, $(expr), $(expr:spec), $raw(expr)
+		FLUSH,  // $flush
+		BLOCK,  // $for, $foreach, $if, $await ... [$else ...] $end
+		EACH    // $foreach(x : range)prefix$x suffix$end, see findBulkLoops()
+	};
+
+	Kind kind = Kind::TEXT;
+	int line = 1;
+	std::string command;     // EMIT, BLOCK: command name as written
+	std::string parameters;  // EMIT, BLOCK: what's inside $(...); EACH: the range
+	std::string text;        // TEXT: what gets written; EACH: static text before the value
+	std::string suffix;      // EACH: static text after the value
+	std::string escape;      // EMIT, EACH: where the value lands, a serenity::templater::Escape value
+	int newlines = 0;        // TEXT, EACH: template lines taken by text and folded commands, kept by every pass
+	std::size_t itemSize = 0;  // $foreach, EACH: static bytes of one iteration, 0 when nothing is reserved, see sizeLoops()
+	std::size_t tailSize = 0;  // $foreach, EACH: static bytes after the loop until the end of the enclosing block
+	std::vector<Node> body;
+	std::vector<Node> elseBody;
+	bool hasElse = false;
+	bool separated = false;    // $for, $foreach in .jsont: directly in an array or object, with commas between iterations
+};
+
+typedef std::vector<Node> Nodes;
+
+int countNewlines(const std::string & s) { return (int)std::count(s.begin(), s.end(), '\n'); }
+
+Node textNode(const std::string & text, int newlines) {
+	Node node;
+	node.text = text;
+	node.newlines = newlines;
+	return node;
+}
+
+std::vector<Segment> lex(std::istream & in) {
 	enum class State {
 		TEXT,                      // skipping to $
 		DOLLAR_COMMAND_NAME,       // skipping to '( or non-alphanumeric
@@ -44,17 +879,26 @@ void preprocess(std::istream & in, std::ostream & out, const std::string & templ
 	};
 
 	State state = State::TEXT;
-	std::string text;
-	std::string command;
-	std::string parameters;
+	std::vector<Segment> segments;
+	Segment segment;
 	int bracketsDepth = 0;
+	int line = 1;
+	std::string & text = segment.text;
+	std::string & command = segment.command;
+	std::string & parameters = segment.parameters;
+
+	auto flush = [&]() {
+		segments.push_back(segment);
+		segment = Segment();
+	};
 
 	for (int c_int = in.get(); (c_int != std::char_traits<char>::eof()) && (in.good()); c_int = in.get()) {
 		char c = (char)c_int;
 		State newState = state;
+		if (c == '\n') line++;
 
 		if (state == State::TEXT) {
-			if (c == '$') { newState = State::DOLLAR_COMMAND_NAME; } else { text += c; }
+			if (c == '$') { newState = State::DOLLAR_COMMAND_NAME; segment.commandLine = line; } else { text += c; }
 		} else if (state == State::DOLLAR_COMMAND_NAME) {
 			if (isalnum(c) || (c == '_')) {
 				command += c;
@@ -63,7 +907,7 @@ void preprocess(std::istream & in, std::ostream & out, const std::string & templ
 				bracketsDepth = 1;
 			} else {
 				newState = State::TEXT;
-				if ((c == '$') && command.empty()) { text += c; } else { in.putback(c); }
+				if ((c == '$') && command.empty()) { text += c; } else { in.putback(c); if (c == '\n') line--; }
 			}
 		} else if (state == State::DOLLAR_COMMAND_PARAMETERS) {
 			if (c == '(') { bracketsDepth++; }
@@ -72,23 +916,575 @@ void preprocess(std::istream & in, std::ostream & out, const std::string & templ
 		}
 
 		if (newState != state) {
-			if (newState == State::TEXT) {
-				if (!text.empty()) writeText(out, text);
-				if (!command.empty() || !parameters.empty()) writeCommand(out, command, parameters);
+			if (newState == State::TEXT) flush();
+			state = newState;
+		}
+	}
+
+	flush();
+	return segments;
+}
+
+// "name" from $await(name : future), empty if it isn't of that shape
+std::string awaitName(const std::string & parameters) {
+	std::size_t colon = findColon(parameters);
+	return (colon == std::string::npos) ? "" : trim(parameters.substr(0, colon));
+}
+
+void parseError(int line, const std::string & message) {
+	std::cout << message << " at line " << line << "\n";
+	returnCode = 1;
+}
 
-				text.clear();
-				command.clear();
-				parameters.clear();
+// Matches $else and $end with their blocks
+Nodes parse(const std::vector<Segment> & segments) {
+	Nodes root;
+	std::vector<Node *> open;  // blocks without $end yet, innermost last; only their bodies grow until they are closed
+	auto current = [&]() -> Nodes & { return open.empty() ? root : open.back()->hasElse ? open.back()->elseBody : open.back()->body; };
+
+	for (const Segment & s : segments) {
+		if (!s.text.empty()) current().push_back(textNode(s.text, countNewlines(s.text)));
+		if (s.command.empty() && s.parameters.empty()) continue;
+
+		if (s.command == "else") {  // $else
+			if (open.empty() || (open.back()->command != "if") || open.back()->hasElse) { parseError(s.commandLine, "unexpected $else"); continue; }
+			open.back()->hasElse = true;
+			continue;
+		}
+		if (s.command == "end") {  // $end
+			if (open.empty()) { parseError(s.commandLine, "unexpected $end"); continue; }
+			open.pop_back();
+			continue;
+		}
+
+		Node node;
+		node.line = s.commandLine;
+		node.command = s.command;
+		node.parameters = s.parameters;
+		bool isBlock = !s.parameters.empty() && ((s.command == "for") || (s.command == "foreach") || (s.command == "if") || (s.command == "await"));
+		if ((s.command == "flush") && s.parameters.empty()) {  // $flush
+			node.kind = Node::Kind::FLUSH;
+		} else if (isBlock) {
+			node.kind = Node::Kind::BLOCK;
+			// $await bodies run after the rest of the template, when loop variables would be gone
+			if (s.command == "await") {
+				if (awaitName(s.parameters).empty()) parseError(s.commandLine, "expected $await(name : future)");
+				if (!open.empty()) parseError(s.commandLine, "$await inside a block");
 			}
+		} else if (s.command.empty() || s.parameters.empty() || (s.command == "raw")) {  // $(var), $var, $raw(var)
+			node.kind = Node::Kind::EMIT;
+		} else {
+			std::cout << "unknown command: $'" << s.command << "'('" << s.parameters << "')";
+			returnCode = 1;
+			continue;
+		}
+		current().push_back(node);
+		if (node.kind == Node::Kind::BLOCK) open.push_back(&current().back());
+	}
 
-			state = newState;
+	for (Node * node : open) parseError(node->line, "$" + node->command + " without $end");
+	return root;
+}
+
+
+// Front end: follows the template's HTML or JSON to find where each value lands, and minifies static text
+
+// Feeds static text to the scanner, returns what gets written
+std::string scanText(Template & t, const std::string & text) {
+	if (options.minify) return t.json ? minifyJson(text, t.jsonScanner) : minifyHtml(text, t.html);
+	if (t.json) t.jsonScanner.feed(text); else t.html.feed(text);
+	return text;
+}
+
+void scan(Template & t, Nodes & nodes) {
+	for (Node & node : nodes) {
+		if (node.kind == Node::Kind::TEXT) node.text = scanText(t, node.text);
+		if (node.kind == Node::Kind::EMIT) {
+			const char * escape = t.json ? t.jsonScanner.escape() : t.html.escape();
+			if (!escape && (node.command != "raw") && options.escape) {
+				parseError(node.line, "interpolation where no escaping keeps the value in place: a script comment or regular expression, an event "
+				                      "handler after a character reference htmltpp doesn't decode, or an unquoted event handler or style attribute");
+			}
+			node.escape = escape ? escape : "HtmlAttribute";
+			if (t.json) t.jsonScanner.interpolate(); else t.html.interpolate();
+		}
+		if ((node.kind == Node::Kind::BLOCK) && ((node.command == "for") || (node.command == "foreach"))) node.separated = t.json && t.jsonScanner.inList();
+		scan(t, node.body);
+		scan(t, node.elseBody);
+	}
+}
+
+
+// Analyses
+
+std::size_t minimumSize(const Nodes & nodes);
+
+// Bytes every render writes: static text outside of loops and conditions, the shorter branch of $if/$else
+std::size_t minimumSize(const Node & node) {
+	if (node.kind == Node::Kind::TEXT) return node.text.size();
+	if ((node.kind == Node::Kind::BLOCK) && (node.command == "await")) return minimumSize(node.body);
+	if ((node.kind == Node::Kind::BLOCK) && (node.command == "if") && node.hasElse) return std::min(minimumSize(node.body), minimumSize(node.elseBody));
+	return 0;
+}
+
+std::size_t minimumSize(const Nodes & nodes) {
+	std::size_t res = 0;
+	for (const Node & node : nodes) res += minimumSize(node);
+	return res;
+}
+
+
+// Optimization passes, run in order by preprocess() unless disabled with --disable-pass=NAME
+
+// $("literal"), $raw('c') and the like are known to htmltpp: their output is static text
+
+// An interpolation that isn't a literal nor $(x:spec) may be a manipulator, like $(std::hex) or $(std::setw(5))
+bool mayChangeStream(const Nodes & nodes) {
+	for (const Node & node : nodes) {
+		std::string value, expression, formatter;
+		char kind;
+		if (mayChangeStream(node.body) || mayChangeStream(node.elseBody)) return true;
+		if (node.kind != Node::Kind::EMIT) continue;
+		bool literal = (node.command.empty() || (node.command == "raw")) && parseLiteral(trim(node.parameters), value, kind);
+		if (!literal && !(node.command.empty() && parseFormatSpec(node.parameters, expression, formatter))) return true;
+	}
+	return false;
+}
+
+// So are numbers and bool, written with operator<<, as long as the stream's formatting state is the initial one:
+// defaultState is false once an interpolation that may change it could have run
+void foldConstants(Template & t, Nodes & nodes, bool & defaultState) {
+	for (Node & node : nodes) {
+		if (node.kind == Node::Kind::BLOCK) {
+			// A loop body also runs after its own previous iterations
+			bool loop = (node.command == "for") || (node.command == "foreach");
+			if (loop && mayChangeStream(node.body)) defaultState = false;
+			bool before = defaultState;
+			foldConstants(t, node.body, defaultState);
+			bool afterBody = defaultState;
+			defaultState = before;
+			foldConstants(t, node.elseBody, defaultState);
+			defaultState = defaultState && afterBody;
+			continue;
+		}
+		if (node.kind != Node::Kind::EMIT) continue;
+		std::string value;
+		char kind;
+		bool literal = (node.command.empty() || (node.command == "raw")) && parseLiteral(trim(node.parameters), value, kind);
+		if (!literal) {
+			if (mayChangeStream(Nodes(1, node))) defaultState = false;
+			continue;
+		}
+		bool raw = (node.command == "raw") || !options.escape;
+		bool formatted = (kind != 's') && (raw || ((node.escape != "JsonValue") && (node.escape != "JsValue") && (node.escape != "JsAttributeValue")));
+		if (formatted && !defaultState) continue;
+		node = textNode(escapeConstant(value, kind, raw ? nullptr : node.escape.c_str()), countNewlines(node.parameters));
+	}
+}
+
+void foldConstants(Template & t, Nodes & nodes) {
+	bool defaultState = true;
+	foldConstants(t, nodes, defaultState);
+}
+
+int sourceNewlines(const Nodes & nodes) {
+	int res = 0;
+	for (const Node & node : nodes) {
+		res += node.newlines + countNewlines(node.parameters) + sourceNewlines(node.body) + sourceNewlines(node.elseBody);
+	}
+	return res;
+}
+
+// $if(true), $if(0) and the like keep only the branch taken
+void removeDeadBranches(Template & t, Nodes & nodes) {
+	Nodes res;
+	for (Node & node : nodes) {
+		removeDeadBranches(t, node.body);
+		removeDeadBranches(t, node.elseBody);
+		std::string value;
+		char kind;
+		if ((node.kind != Node::Kind::BLOCK) || (node.command != "if") || !parseLiteral(trim(node.parameters), value, kind) || (kind == 's')) {
+			res.push_back(node);
+			continue;
+		}
+		bool taken = (value != "false") && (value != "0");
+		Nodes & branch = taken ? node.body : node.elseBody;
+		res.push_back(textNode("", countNewlines(node.parameters) + (taken ? 0 : sourceNewlines(node.body))));
+		res.insert(res.end(), branch.begin(), branch.end());
+		res.push_back(textNode("", taken ? sourceNewlines(node.elseBody) : 0));
+	}
+	nodes.swap(res);
+}
+
+// One write per run of static text
+void mergeText(Template & t, Nodes & nodes) {
+	Nodes res;
+	for (Node & node : nodes) {
+		mergeText(t, node.body);
+		mergeText(t, node.elseBody);
+		if ((node.kind == Node::Kind::TEXT) && !res.empty() && (res.back().kind == Node::Kind::TEXT)) {
+			res.back().text += node.text;
+			res.back().newlines += node.newlines;
+		} else {
+			res.push_back(node);
 		}
 	}
+	nodes.swap(res);
+}
+
+// $foreach(x : range)prefix$x suffix$end, the shape of numeric lists and table columns, becomes one call that
+// formats contiguous ranges of integers in bulk
+void findBulkLoops(Template & t, Nodes & nodes) {
+	for (Node & node : nodes) {
+		findBulkLoops(t, node.body);
+		findBulkLoops(t, node.elseBody);
+		if (!options.escape || options.profile || options.pgoGenerate || t.json) continue;
+		if ((node.kind != Node::Kind::BLOCK) || (node.command != "foreach")) continue;
+		std::size_t colon = findColon(node.parameters);
+		if ((colon == std::string::npos) || isBracedList(node.parameters.substr(colon + 1))) continue;  // not a template argument
+		std::string name = trim(node.parameters.substr(0, colon));
 
-	if (!text.empty()) writeText(out, text);
-	if (!command.empty() || !parameters.empty()) writeCommand(out, command, parameters);
+		const Nodes & body = node.body;
+		std::size_t item = (!body.empty() && (body[0].kind == Node::Kind::TEXT)) ? 1 : 0;
+		if ((item >= body.size()) || (body.size() > item + 2) || ((item + 1 < body.size()) && (body[item + 1].kind != Node::Kind::TEXT))) continue;
+		const Node & emit = body[item];
+		bool isItem = (emit.kind == Node::Kind::EMIT) &&
+		              (((emit.command == name) && emit.parameters.empty()) || (emit.command.empty() && (trim(emit.parameters) == name)));
+		if (!isIdentifier(name) || !isItem) continue;
 
-	out << "return " RESULT_VARIABLE_NAME ".str();}\n";
+		Node each;
+		each.kind = Node::Kind::EACH;
+		each.line = node.line;
+		each.parameters = node.parameters.substr(colon + 1);
+		each.escape = emit.escape;
+		each.newlines = countNewlines(node.parameters.substr(0, colon)) + countNewlines(emit.parameters);
+		if (item == 1) { each.text = body[0].text; each.newlines += body[0].newlines; }
+		if (item + 1 < body.size()) { each.suffix = body[item + 1].text; each.newlines += body[item + 1].newlines; }
+		node = each;
+	}
+}
+
+// A table of 10000 rows outgrows the estimate of a table of 100 on its first render, and regrows its buffer a dozen
+// times on the way. Before each $foreach over a range with size(), the stream reserves the loop's static text
+// times the number of elements, plus the static text after the loop
+void sizeLoops(Template & t, Nodes & nodes) {
+	std::size_t tail = 0;
+	for (auto node = nodes.rbegin(); node != nodes.rend(); tail += minimumSize(*node++)) {
+		sizeLoops(t, node->body);
+		sizeLoops(t, node->elseBody);
+		if (node->kind == Node::Kind::EACH) {
+			node->itemSize = node->text.size() + 1 + node->suffix.size();  // at least one digit
+		} else if ((node->kind == Node::Kind::BLOCK) && (node->command == "foreach") && (findColon(node->parameters) != std::string::npos)) {
+			node->itemSize = minimumSize(node->body) + (node->separated ? 1 : 0);  // JSON: the comma
+		}
+		node->tailSize = tail;
+	}
+}
+
+struct Pass {
+	const char * name;
+	void (*run)(Template & t, Nodes & nodes);
+};
+
+const Pass passes[] = {
+	{ "fold-constants", foldConstants },
+	{ "dead-branches", removeDeadBranches },
+	{ "merge-text", mergeText },
+	{ "bulk-loops", findBulkLoops },
+	{ "reserve-loops", sizeLoops },
+};
+
+
+// Statements backend: C++ statements writing to RESULT_VARIABLE_NAME
+
+void writeInterpolation(std::ostream & out, const std::string & escape, const std::string & expression) {
+	if (options.escape) {
+		out << ESCAPE_FUNCTION "<serenity::templater::Escape::" << escape << ">(" RESULT_VARIABLE_NAME ",(" << expression << "));";
+	} else {
+		out << RESULT_VARIABLE_NAME "<<" << expression << ";";
+	}
+}
+
+void writeNodes(std::ostream & out, Template & t, const Nodes & nodes);
+
+void writeEmit(std::ostream & out, Template & t, const Node & node) {
+	const std::string parameters = continueLines(node.parameters);
+	if (options.profile) {
+		out << "{";
+		writeProfilingTimer(out, t, node.line, describeCommand(node.command, node.parameters));
+	}
+	std::string expression, formatter;
+	if (node.command.empty() && parseFormatSpec(parameters, expression, formatter)) {  // $(var:spec)
+		out << formatter << "(" RESULT_VARIABLE_NAME ",(" << expression << "));";
+	} else
+	if (node.command.empty())   writeInterpolation(out, node.escape, parameters); else    // $(var)
+	if (parameters.empty())     writeInterpolation(out, node.escape, node.command); else  // $var
+	/* node.command == "raw" */ out << RESULT_VARIABLE_NAME "<<" << parameters << ";";     // $raw(var)
+	if (options.profile) out << "}";
+}
+
+// Binds the range of a $foreach to a variable, reserving for the whole loop unless sizeLoops() found nothing to reserve.
+// Returns the range to iterate over
+std::string writeReservation(std::ostream & out, Template & t, const Node & node, const std::string & range) {
+	if (node.itemSize == 0) return rangeInitializer(range);
+	std::string name = RANGE_VARIABLE_NAME + std::to_string(t.sites++);
+	out << "auto&&" << name << "=" << rangeInitializer(range) << ";";
+	out << RESERVE_FUNCTION "(" RESULT_VARIABLE_NAME "," << node.tailSize << "+" RANGE_SIZE_FUNCTION "(" << name << ")*" << node.itemSize << ");";
+	return name;
+}
+
+void writeEach(std::ostream & out, Template & t, const Node & node) {
+	out << "{";
+	std::string range = writeReservation(out, t, node, continueLines(node.parameters));
+	out << EACH_FUNCTION "<serenity::templater::Escape::" << node.escape << ">(" RESULT_VARIABLE_NAME "," << range << ",";
+	out << (node.text.empty() ? "nullptr,0" : poolReference(t, node.text)) << ",";
+	out << (node.suffix.empty() ? "nullptr,0" : poolReference(t, node.suffix)) << ");}";
+	out << continueLines(std::string((size_t)node.newlines, '\n'));
+}
+
+// $await(name : future) ... $end: the body becomes a lambda taking future.get() as name, rendered once the future
+// is ready, and the rest of the template goes on meanwhile
+void writeAwait(std::ostream & out, Template & t, const Node & node) {
+	const std::string parameters = continueLines(node.parameters);
+	std::string future = "(" + parameters.substr(findColon(parameters) + 1) + ")";
+	if (t.awaits++ == 0) out << "serenity::templater::AwaitQueue " AWAIT_QUEUE_VARIABLE_NAME "(" RESULT_VARIABLE_NAME ");";
+	out << AWAIT_QUEUE_VARIABLE_NAME ".defer(" << future << ",[&](std::ostream&" RESULT_VARIABLE_NAME ",";
+	out << "decltype(" << future << ".get())" << awaitName(parameters) << "){";
+	writeNodes(out, t, node.body);
+	out << "});";
+	// The rest of the template goes after the section, which the queue buffers while the future is pending
+	if (t.awaits == 1) out << "std::ostream&" RESULT_VARIABLE_NAME "=" AWAIT_QUEUE_VARIABLE_NAME ".tail();";
+}
+
+// $for, $foreach and $if, with their instrumentation and profile-guided layout
+void writeBlock(std::ostream & out, Template & t, const Node & node) {
+	const std::string & command = node.command;
+	const std::string parameters = continueLines(node.parameters);
+	std::string kind = describeCommand(command, node.parameters);
+	Block block;
+	if (options.profile) {
+		out << "{";
+		block.wrappers++;
+		writeProfilingTimer(out, t, node.line, kind);
+	}
+
+	// Branch probabilities from a previous --pgo-generate run
+	auto entry = profile.find(profileKey(t.name, node.line, kind));
+	bool rarelyTaken = false, mostlyTaken = false;
+	if (entry != profile.end() && (entry->second.executions > 0)) {
+		double p = (double)entry->second.taken / (double)entry->second.executions;
+		rarelyTaken = (p < 0.05);
+		mostlyTaken = (p > 0.95) && (command == "if");
+	}
+	block.coldBody = rarelyTaken;
+	block.coldElse = mostlyTaken;
+
+	std::string counter, separator;
+	if (options.pgoGenerate) {
+		out << "{";
+		block.wrappers++;
+		counter = writePgoCounter(out, t, node.line, kind);
+	}
+
+	if (command == "if") {  // $if (cond)
+		std::string condition = "(" + parameters + ")";
+		if (!counter.empty()) condition = "(" + counter + ".branch(" + condition + "))";
+		if (rarelyTaken) condition = "(__builtin_expect(!!" + condition + ",0))";
+		if (mostlyTaken) condition = "(__builtin_expect(!!" + condition + ",1))";
+		out << "if" << condition << "{";
+	} else {
+		if (!counter.empty()) out << counter << ".execute();";
+		// JSON arrays and objects need a comma before every iteration that writes something but the first.
+		// 0: nothing written yet, 1: written by an earlier iteration, 2: written by this one
+		if (node.separated) {
+			out << "{";
+			block.wrappers++;
+			separator = SEPARATOR_VARIABLE_NAME + std::to_string(t.sites++);
+			out << "int " << separator << "=0;";
+		}
+		if (command == "for")     out << "for(" << parameters << "){"; else        // $for (int i=0; i<n; i++)
+		if (command == "foreach") {                                                 // $foreach(item : collection)
+			std::size_t colon = findColon(parameters);
+			if (node.itemSize > 0) {
+				out << "{";
+				block.wrappers++;
+				std::string range = writeReservation(out, t, node, parameters.substr(colon + 1));
+				out << "for(auto&&" << parameters.substr(0, colon) << ":" << range << "){";
+			} else {
+				out << "for(auto&&" << parameters << "){";
+			}
+		}
+		if (!counter.empty()) out << counter << ".take();";
+		bool startsWithText = !node.body.empty() && (node.body[0].kind == Node::Kind::TEXT) && !node.body[0].text.empty();
+		if (!separator.empty() && startsWithText) {
+			// Every iteration writes, static text first: the comma goes right away
+			out << "if(" << separator << ")" RESULT_VARIABLE_NAME ".put(',');" << separator << "=1;";
+		} else if (!separator.empty()) {
+			// Otherwise before the first write, see writeNodes()
+			out << "if(" << separator << "==2)" << separator << "=1;";
+			t.separators.push_back(separator);
+		}
+	}
+	if (block.coldBody) out << COLD_FUNCTION_BEGIN;
+	writeNodes(out, t, node.body);
+	if (!t.separators.empty() && (t.separators.back() == separator)) t.separators.pop_back();
+
+	if (node.hasElse) {  // $else
+		out << (block.coldBody ? "}();}else{" : "}else{") << (block.coldElse ? COLD_FUNCTION_BEGIN : "");
+		writeNodes(out, t, node.elseBody);
+	}
+	out << ((node.hasElse ? block.coldElse : block.coldBody) ? "}();}" : "}") << std::string((size_t)block.wrappers, '}');
+}
+
+// Everything but static text
+void writeCommand(std::ostream & out, Template & t, const Node & node) {
+	// A streaming sink sends the static prefix (typically <head>) before anything is computed
+	if (t.inPrefix && t.prefixText && (node.kind != Node::Kind::FLUSH)) out << FLUSH_PREFIX_FUNCTION "(" RESULT_VARIABLE_NAME ");";
+	t.inPrefix = false;
+
+	switch (node.kind) {
+		case Node::Kind::EMIT:  writeEmit(out, t, node); break;
+		case Node::Kind::FLUSH: out << RESULT_VARIABLE_NAME ".flush();"; break;
+		case Node::Kind::EACH:  writeEach(out, t, node); break;
+		case Node::Kind::BLOCK: if (node.command == "await") writeAwait(out, t, node); else writeBlock(out, t, node); break;
+		case Node::Kind::TEXT:  break;
+	}
+}
+
+void writeNodes(std::ostream & out, Template & t, const Nodes & nodes) {
+	std::vector<std::string> separators;
+	for (const Node & node : nodes) {
+		bool writes = ((node.kind == Node::Kind::TEXT) && !node.text.empty()) || (node.kind == Node::Kind::EMIT);
+		if (writes && !t.separators.empty()) {
+			// The commas of the loops around, outermost first. The rest of this block runs after this point
+			for (const std::string & separator : t.separators) {
+				out << "if(" << separator << "!=2){if(" << separator << ")" RESULT_VARIABLE_NAME ".put(',');" << separator << "=2;}";
+			}
+			separators.swap(t.separators);
+		}
+		if (node.kind == Node::Kind::TEXT) {
+			out << continueLines(std::string((size_t)node.newlines, '\n'));
+			if (!node.text.empty()) writeText(out, t, node.text);
+			t.prefixText = t.prefixText || (t.inPrefix && !node.text.empty());
+		} else {
+			writeCommand(out, t, node);
+		}
+	}
+	if (!separators.empty()) t.separators.swap(separators);
+}
+
+void writeStatements(std::ostream & out, Template & t, const Nodes & nodes, const std::string & fileName) {
+	out << "#line 1 " << cStringLiteral(fileName) << "\n";
+	// Just the statements; TEMPLATE() and friends declare RESULT_VARIABLE_NAME around them
+	out << "#define " MACRO_PREFIX << t.name << " {";
+	writeNodes(out, t, nodes);
+	if (t.awaits > 0) out << AWAIT_QUEUE_VARIABLE_NAME ".finish();";
+	out << "}\n";
+}
+
+
+// Table backend: the template's top level as a static table of ops run by serenity::templater::run(). Static text
+// is an offset and size in the string pool; everything else is a case of one lambda, the thunks, called in order.
+// A long flat template becomes data and one small loop instead of thousands of inlined writes
+
+// Top-level commands, each one thunk, and runs of static text, each one op
+std::size_t countOps(const Nodes & nodes) {
+	return (std::size_t)std::count_if(nodes.begin(), nodes.end(), [](const Node & node) { return (node.kind != Node::Kind::TEXT) || !node.text.empty(); });
+}
+
+// $await shadows RESULT_VARIABLE_NAME for the rest of the template, which can't be split into thunks
+bool fitsTable(const Nodes & nodes) {
+	return std::none_of(nodes.begin(), nodes.end(), [](const Node & node) { return (node.kind == Node::Kind::BLOCK) && (node.command == "await"); });
+}
+
+// A heuristic, not a measured crossover. On benchmarks/templates (g++ -O3 -flto) the table made array1000, 20000 ops,
+// 5-10% faster and the benchmark's text 915 KB -> 877 KB, and a 12000-line template compiled at -O2 in 3.5s instead
+// of 13s. Small templates rendered at the same speed either way, so the table is left to long ones
+const std::size_t TABLE_MIN_OPS = 256;
+const unsigned TABLE_GROUP_SIZE = 256;
+
+bool useTable(const Nodes & nodes) {
+	if (!fitsTable(nodes) || (options.backend == "inline")) return false;
+	return (options.backend == "table") || (countOps(nodes) >= TABLE_MIN_OPS);
+}
+
+void writeTable(std::ostream & out, Template & t, const Nodes & nodes, const std::string & fileName) {
+	out << "#line 1 " << cStringLiteral(fileName) << "\n";
+	out << "#define " MACRO_PREFIX << t.name << " {";
+	out << "static const serenity::templater::Op " OPS_VARIABLE_NAME "[]={";
+	const char * separator = "";
+	for (const Node & node : nodes) {
+		if (node.kind != Node::Kind::TEXT) out << separator << "{0,0}";
+		else if (!node.text.empty()) out << separator << "{" << poolOffset(t, node.text) << "," << node.text.size() << "}";
+		else continue;
+		separator = ",";
+	}
+	out << "};";
+
+	// Thunks in groups of TABLE_GROUP_SIZE, each a function of its own: compilers take superlinear time
+	// on one switch of thousands of cases. The lines of the template go along the cases, keeping expressions on their lines
+	unsigned thunk = 0;
+	for (const Node & node : nodes) {
+		if (node.kind == Node::Kind::TEXT) {
+			out << continueLines(std::string((size_t)node.newlines, '\n'));
+			t.prefixText = t.prefixText || (t.inPrefix && !node.text.empty());
+			continue;
+		}
+		if (thunk % TABLE_GROUP_SIZE == 0) {
+			if (thunk > 0) out << "}};";
+			out << "auto " THUNKS_VARIABLE_NAME << thunk / TABLE_GROUP_SIZE << "=[&](unsigned " THUNK_VARIABLE_NAME ")__attribute__((noinline)){";
+			out << "switch(" THUNK_VARIABLE_NAME "){";
+		}
+		out << "case " << thunk++ << ":{";
+		writeCommand(out, t, node);
+		out << "}break;";
+	}
+	if (thunk > 0) out << "}};";
+	out << "auto " THUNKS_VARIABLE_NAME "=[&](unsigned " THUNK_VARIABLE_NAME "){switch(" THUNK_VARIABLE_NAME "/" << TABLE_GROUP_SIZE << "){";
+	for (unsigned group = 0; group * TABLE_GROUP_SIZE < thunk; group++) {
+		out << "case " << group << ":" THUNKS_VARIABLE_NAME << group << "(" THUNK_VARIABLE_NAME ");break;";
+	}
+	out << "}};";
+	std::string poolData = t.strings.empty() ? std::string("nullptr") : pool.function + "()";
+	out << RUN_FUNCTION "(" RESULT_VARIABLE_NAME "," << poolData << "," OPS_VARIABLE_NAME ",";
+	out << countOps(nodes) << "," THUNKS_VARIABLE_NAME ");}\n";
+}
+
+
+// Static view backend: the output of a template that is only static text is one string of the pool, which TEMPLATE_VIEW()
+// returns as is
+
+void writeStaticView(std::ostream & out, Template & t, const std::string & text) {
+	out << "inline serenity::templater::StaticView " STATIC_VIEW_FUNCTION_PREFIX << t.name << "(){";
+	if (text.empty()) {
+		out << "return serenity::templater::StaticView{\"\",0};}\n";
+	} else {
+		out << "return serenity::templater::StaticView{" << poolReference(t, text) << "};}\n";
+	}
+	std::string view = STATIC_VIEW_FUNCTION_PREFIX + t.name + "()";
+	out << "#define " MACRO_PREFIX << t.name << " {" STATIC_FUNCTION "(" RESULT_VARIABLE_NAME "," << view << ".data," << view << ".size);}\n";
+}
+
+
+// "targets: dependencies" for make, with an empty rule per dependency (like -MP) so that deleting a template
+// doesn't break the build
+std::string makeRule(const std::vector<std::string> & targets, const std::vector<std::string> & dependencies) {
+	auto escape = [](const std::string & fileName) {
+		std::string res;
+		for (char c : fileName) {
+			if ((c == ' ') || (c == '#')) res += '\\';
+			if (c == '$') res += '$';
+			res += c;
+		}
+		return res;
+	};
+	std::string res;
+	for (const std::string & target : targets) res += (res.empty() ? "" : " ") + escape(target);
+	res += ":";
+	for (const std::string & dependency : dependencies) res += " \\\n  " + escape(dependency);
+	res += "\n";
+	for (const std::string & dependency : dependencies) res += "\n" + escape(dependency) + ":\n";
+	return res;
 }
 
 std::string fileNameToTemplateName(const std::string & fileName) {
@@ -99,20 +1495,199 @@ std::string fileNameToTemplateName(const std::string & fileName) {
 	return fileName.substr(begin+1, end-begin-1);
 }
 
+// Generated code of a template, waiting for the string pool of its output file
+struct Unit {
+	std::vector<std::string> strings;  // Template::strings
+	std::string code;                  // with placeholders for offsets in the pool
+};
+
+Unit preprocess(std::istream & in, const std::string & fileName, const std::string & templateName) {
+	Template t;
+	t.name = templateName;
+	t.json = (fileName.size() >= 6) && (fileName.compare(fileName.size() - 6, 6, ".jsont") == 0);
+
+	Nodes nodes = parse(lex(in));
+	scan(t, nodes);
+	for (const Pass & pass : passes) {
+		if (std::find(options.disabledPasses.begin(), options.disabledPasses.end(), pass.name) == options.disabledPasses.end()) pass.run(t, nodes);
+	}
+
+	std::ostringstream out;
+	out << "inline serenity::templater::OutputSize & " OUTPUT_SIZE_FUNCTION_PREFIX << templateName << "(){";
+	out << "static serenity::templater::OutputSize s(" << cStringLiteral(templateName) << "," << minimumSize(nodes) << ");return s;}\n";
+
+	bool isStatic = std::all_of(nodes.begin(), nodes.end(), [](const Node & node) { return node.kind == Node::Kind::TEXT; });
+	if (isStatic) {
+		std::string text;
+		for (const Node & node : nodes) text += node.text;
+		writeStaticView(out, t, text);
+	} else if (useTable(nodes)) {
+		writeTable(out, t, nodes, fileName);
+	} else {
+		writeStatements(out, t, nodes, fileName);
+	}
+
+	Unit unit;
+	unit.strings.swap(t.strings);
+	unit.code = out.str();
+	return unit;
+}
+
+
+// Preprocess cache, --cache=DIR: one file per template, named after a hash of everything its generated code
+// depends on. A template that is unchanged since the last build isn't parsed again
+
+std::uint64_t fnv1a(const std::string & s, std::uint64_t hash = 14695981039346656037ULL) {
+	for (char c : s) {
+		hash ^= (unsigned char)c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// The htmltpp binary itself, so that a rebuilt htmltpp doesn't reuse code generated by the previous one
+std::string htmltppVersion;
+
+std::string cacheKey(const std::string & fileName, const std::string & templateName, const std::string & content) {
+	std::ostringstream key;
+	key << htmltppVersion.size() << '\0' << fnv1a(htmltppVersion) << '\0';
+	key << options.profile << options.pgoGenerate << options.escape << options.minify << options.backend << '\0';
+	for (const std::string & pass : options.disabledPasses) key << pass << '\0';
+	for (const auto & entry : profile) key << entry.first << '\t' << entry.second.executions << '\t' << entry.second.taken << '\n';
+	key << '\0' << pool.function << '\0' << fileName << '\0' << templateName << '\0' << content;
+	std::string res = key.str();
+	char hex[33];
+	snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)fnv1a(res), (unsigned long long)fnv1a(res, fnv1a(fileName)));
+	return hex;
+}
+
+// Entry format: number of strings, then each string as its size and bytes, then the code as its size and bytes
+bool readCacheEntry(const std::string & entryName, Unit & unit) {
+	std::string entry = readFile(entryName);
+	std::istringstream in(entry);
+	std::size_t count, size;
+	if (!(in >> count) || (in.get() != '\n')) return false;
+	for (std::size_t i = 0; i < count; i++) {
+		if (!(in >> size) || (in.get() != '\n')) return false;
+		std::string s(size, '\0');
+		if (size && !in.read(&s[0], (std::streamsize)size)) return false;
+		unit.strings.push_back(s);
+	}
+	if (!(in >> size) || (in.get() != '\n')) return false;
+	unit.code.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	return unit.code.size() == size;
+}
+
+void writeCacheEntry(const std::string & entryName, const Unit & unit) {
+	std::ostringstream entry;
+	entry << unit.strings.size() << '\n';
+	for (const std::string & s : unit.strings) entry << s.size() << '\n' << s;
+	entry << unit.code.size() << '\n' << unit.code;
+	// Written under a name of this process and renamed, so that parallel builds never read a partial entry
+	std::string tmpName = entryName + ".tmp" + std::to_string(getpid());
+	std::ofstream out(tmpName, std::ios::out | std::ios::binary);
+	out << entry.str();
+	out.close();
+	if (!out || (std::rename(tmpName.c_str(), entryName.c_str()) != 0)) std::remove(tmpName.c_str());
+}
+
+Unit preprocessFile(const std::string & fileName) {
+	std::string templateName = fileNameToTemplateName(fileName);
+	std::string content = readFile(fileName);
+	std::istringstream in(content);
+	if (options.cache.empty()) return preprocess(in, fileName, templateName);
+
+	Unit unit;
+	std::string entryName = options.cache + "/" + cacheKey(fileName, templateName, content);
+	if (readCacheEntry(entryName, unit)) return unit;
+	// Templates with errors aren't cached, so that the errors show up again
+	int previousReturnCode = returnCode;
+	returnCode = 0;
+	unit = preprocess(in, fileName, templateName);
+	if (returnCode == 0) writeCacheEntry(entryName, unit);
+	returnCode = std::max(returnCode, previousReturnCode);
+	return unit;
+}
+
 }
 
 
 int main(int argc, char ** argv) {
-	if ((argc < 2) || (std::string(argv[1]) == "-h") || (std::string(argv[1]) == "--help")) {
-		printf("Usage:\n  %s output-file.htmltc input-file1.htmlt ... input-fileN.htmlt", argv[0]);
+	int firstArg = 1;
+	for (; (firstArg < argc) && (argv[firstArg][0] == '-'); firstArg++) {
+		std::string option = argv[firstArg];
+		if (option == "--profile") { options.profile = true; } else
+		if (option == "--pgo-generate") { options.pgoGenerate = true; } else
+		if (option == "--no-escape") { options.escape = false; } else
+		if (option == "--minify") { options.minify = true; } else
+		if (option == "--incbin") { options.incbin = true; } else
+		if (option.compare(0, 10, "--pgo-use=") == 0) { options.pgoUse = option.substr(10); } else
+		if (option.compare(0, 15, "--disable-pass=") == 0) { options.disabledPasses.push_back(option.substr(15)); } else
+		if (option.compare(0, 8, "--cache=") == 0) { options.cache = option.substr(8); } else
+		if ((option == "-MF") && (firstArg + 1 < argc)) { options.depFile = argv[++firstArg]; } else
+		if ((option == "-MT") && (firstArg + 1 < argc)) { options.depTargets.push_back(argv[++firstArg]); } else
+		if (option == "-MD") { if (options.depFile.empty()) options.depFile = "-"; } else
+		if ((option == "--backend=auto") || (option == "--backend=inline") || (option == "--backend=table")) { options.backend = option.substr(10); } else {
+			if ((option != "-h") && (option != "--help")) std::cout << "unknown option: '" << option << "'\n";
+			firstArg = argc;
+		}
+	}
+
+	if (firstArg >= argc) {
+		printf("Usage:\n  %s [options] output-file.htmltc input-file1.htmlt ... input-fileN.htmlt\n"
+		       "Templates with the .jsont extension produce JSON\n"
+		       "Options:\n"
+		       "  --profile        instrument blocks and interpolations, see serenity::templater::profiling::report()\n"
+		       "  --pgo-generate   count branches and loop iterations, see serenity::templater::pgo::writeProfile()\n"
+		       "  --pgo-use=FILE   lay out branches using a profile written by an --pgo-generate build\n"
+		       "  --no-escape      don't escape interpolated strings for their HTML or JSON context\n"
+		       "  --minify         strip HTML comments and collapse whitespace in static text\n"
+		       "  --incbin         write static text to output-file.htmltc.bin, included by the assembler (ELF targets)\n"
+		       "  --cache=DIR      reuse code generated for unchanged templates, from files in DIR\n"
+		       "  -MD              write a make rule with the files the output depends on to output-file.d\n"
+		       "  -MF FILE         write that rule to FILE instead\n"
+		       "  -MT TARGET       make the rule for TARGET instead of the output files\n"
+		       "  --disable-pass=NAME  skip an optimization pass: fold-constants, dead-branches, merge-text, bulk-loops, reserve-loops\n"
+		       "  --backend=MODE   code for templates with dynamic parts: inline statements, a table of ops, or auto (default),\n"
+		       "                   the table for templates with hundreds of static runs and commands\n", argv[0]);
 		return 1;
 	}
 
-	std::ofstream out(argv[1]);
+	if (!options.pgoUse.empty()) readProfile(options.pgoUse);
+
+	if (!options.cache.empty()) {
+		htmltppVersion = readFile("/proc/self/exe");
+		if (htmltppVersion.empty()) htmltppVersion = readFile(argv[0]);
+		// Without the binary in the key, a rebuilt htmltpp would reuse stale code
+		if (htmltppVersion.empty()) {
+			std::cout << "can't read the htmltpp binary, --cache is disabled\n";
+			options.cache.clear();
+		}
+	}
+
+	// Named after the first template, so that output files can be included together
+	if (firstArg + 1 < argc) pool.function = POOL_FUNCTION_PREFIX + fileNameToTemplateName(argv[firstArg + 1]);
+	std::vector<Unit> units;
+	for (int i = firstArg + 1; i < argc; i++) units.push_back(preprocessFile(argv[i]));
+	for (const Unit & unit : units) {
+		for (const std::string & s : unit.strings) pool.add(s);
+	}
+	pool.build();
+
+	std::ostringstream out;
 	out << "#include <serenity/templater.hpp>\n";
-	for (int i = 2; i < argc; i++) {
-  	std::ifstream in(argv[i], std::ios::in | std::ios::binary);
-		preprocess(in, out, fileNameToTemplateName(argv[i]));
+	if (options.incbin) pool.writeIncbin(out, std::string(argv[firstArg]) + ".bin"); else pool.write(out);
+	for (const Unit & unit : units) out << resolvePool(unit.code, unit.strings);
+	// An unchanged output keeps its timestamp, and what includes it isn't rebuilt
+	writeIfChanged(argv[firstArg], out.str());
+
+	if (!options.depFile.empty()) {
+		std::vector<std::string> targets(1, argv[firstArg]), dependencies(argv + firstArg + 1, argv + argc);
+		if (options.incbin && !pool.data.empty()) targets.push_back(targets[0] + ".bin");
+		if (!options.pgoUse.empty()) dependencies.push_back(options.pgoUse);
+		std::string depFile = options.depFile;
+		if (depFile == "-") depFile = targets[0].substr(0, targets[0].rfind('.')) + ".d";  // -MD: output-file.htmltc -> output-file.d
+		writeIfChanged(depFile, makeRule(options.depTargets.empty() ? targets : options.depTargets, dependencies));
 	}
 	return returnCode;
 }
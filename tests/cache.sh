@@ -0,0 +1,44 @@
+#!/bin/sh
+# htmltpp --cache: a hit gives the same output as no cache, a changed option or profile misses
+# Usage: tests/cache.sh path/to/serenity-htmltpp
+
+HTMLTPP=$1
+DIR=$(mktemp -d)
+trap 'rm -Rf "$DIR"' EXIT
+mkdir "$DIR/cache"
+TEMPLATES=$(ls tests/templates/*.htmlt tests/templates/*.jsont)
+
+fail() {
+	echo "cache test failed: $1"
+	exit 1
+}
+
+entries() {
+	ls "$DIR/cache" | wc -l
+}
+
+# Runs htmltpp with the cache and without it, and compares the outputs
+check() {
+	"$HTMLTPP" "$@" "$DIR/uncached.htmltc" $TEMPLATES > /dev/null || fail "htmltpp $*"
+	"$HTMLTPP" --cache="$DIR/cache" "$@" "$DIR/cached.htmltc" $TEMPLATES > /dev/null || fail "htmltpp --cache $*"
+	cmp -s "$DIR/uncached.htmltc" "$DIR/cached.htmltc" || fail "output with the cache differs, $*"
+}
+
+check
+COUNT=$(entries)
+[ "$COUNT" -gt 0 ] || fail "nothing cached"
+check
+[ "$(entries)" -eq "$COUNT" ] || fail "unchanged templates missed"
+
+check --minify
+[ "$(entries)" -gt "$COUNT" ] || fail "a changed option hit"
+COUNT=$(entries)
+
+printf 'each\t1\t1\t1\t$foreach(n : numbers)$\n' > "$DIR/profile"
+check --minify --pgo-use="$DIR/profile"
+[ "$(entries)" -gt "$COUNT" ] || fail "a changed profile hit"
+COUNT=$(entries)
+check --minify --pgo-use="$DIR/profile"
+[ "$(entries)" -eq "$COUNT" ] || fail "an unchanged profile missed"
+
+echo "Cache test passed"
@@ -1,4 +1,29 @@
 #include <tests/templates.htmltc>
+#include <tests/profiled.htmltc>
+#include <tests/instrumented.htmltc>
+#include <tests/pgo.htmltc>
+#include <tests/minified.htmltc>
+#include <tests/tabled.htmltc>
+#include <tests/incbin.htmltc>
+#include <list>
+
+
+namespace {
+
+// Counts heap allocations while countAllocations is set
+bool countAllocations = false;
+int allocations = 0;
+
+}
+
+void * operator new(std::size_t size) {
+	if (countAllocations) allocations++;
+	void * p = std::malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void * p) noexcept { std::free(p); }
 
 
 namespace {
@@ -34,6 +59,280 @@ TEST_CASE( "preprocess static" ) {
 	CHECK( res == correctAnswer );
 }
 
+TEST_CASE( "output size estimate" ) {
+	std::string res = TEMPLATE(static);
+	CHECK( serenity::templater::outputSizeEstimates()["static"] == res.size() );
+	res = TEMPLATE(static);
+	CHECK( res == correctAnswer );
+	CHECK( serenity::templater::outputSizeEstimates()["static"] == res.size() );
+}
+
+TEST_CASE( "render into an existing buffer" ) {
+	std::string title = "Hello!";
+	std::string buffer = "HTTP/1.1 200 OK\r\n\r\n";
+	CHECK( TEMPLATE_INTO(one_var, buffer) == std::string(correctAnswer).size() );
+	CHECK( buffer == "HTTP/1.1 200 OK\r\n\r\n" + std::string(correctAnswer) );
+
+	buffer.clear();
+	const char * data = buffer.data();
+	TEMPLATE_INTO(one_var, buffer);
+	CHECK( buffer == correctAnswer );
+	CHECK( buffer.data() == data );
+
+	std::vector<char> chars;
+	TEMPLATE_INTO(one_var, chars);
+	CHECK( std::string(chars.begin(), chars.end()) == correctAnswer );
+}
+
+TEST_CASE( "render into a fixed buffer without allocating" ) {
+	std::string title = "Hello!";
+	int number1 = 1;
+	float floatNumber1 = 1.125;
+	std::array<unsigned short, 3> ints = {{ 1, 2, 3 }};
+	std::vector<double> floats = {{ 1.125, 2.567, 3.874 }};
+	char buffer[512];
+	serenity::templater::RenderResult results[5];
+
+	allocations = 0;
+	countAllocations = true;
+	results[0] = TEMPLATE_TO_BUFFER(static, buffer, sizeof(buffer));
+	results[1] = TEMPLATE_TO_BUFFER(one_var, buffer, sizeof(buffer));
+	results[2] = TEMPLATE_TO_BUFFER(int_var, buffer, sizeof(buffer));
+	{
+		float number1 = floatNumber1;
+		results[3] = TEMPLATE_TO_BUFFER(float_var, buffer, sizeof(buffer));
+	}
+	results[4] = TEMPLATE_TO_BUFFER(array_vector, buffer, sizeof(buffer));
+	countAllocations = false;
+
+	CHECK( allocations == 0 );
+	for (const auto & result : results) {
+		CHECK( !result.overflow );
+		CHECK( result.size == std::string(correctAnswer).size() );
+	}
+	CHECK( std::string(buffer, results[4].size) == correctAnswer );
+
+	serenity::templater::RenderResult result = TEMPLATE_TO_BUFFER(array_vector, buffer, 10);
+	CHECK( result.overflow );
+	CHECK( result.size == std::string(correctAnswer).size() );
+	CHECK( std::string(buffer, 10) == std::string(correctAnswer).substr(0, 10) );
+}
+
+TEST_CASE( "render into a rope" ) {
+	std::vector<int> ints(1000, 123456);
+	std::vector<float> floats = {1.5f, 2.25f};
+	std::string correctAnswer = TEMPLATE(array_vector);
+
+	serenity::templater::Rope copy;
+	{
+		serenity::templater::Rope rope = TEMPLATE_ROPE(array_vector);
+		CHECK( rope.size() == correctAnswer.size() );
+		CHECK( rope.chunks().size() > correctAnswer.size() / serenity::templater::Rope::blockSize );
+		// The static text before the first $foreach is long enough to be borrowed as a whole
+		CHECK( rope.chunks()[0].size == correctAnswer.find("<li>") );
+
+		std::size_t iovecBytes = 0;
+		for (const iovec & v : rope.iovecs()) iovecBytes += v.iov_len;
+		CHECK( iovecBytes == correctAnswer.size() );
+		copy = rope;
+	}
+	CHECK( copy.flatten() == correctAnswer );
+}
+
+TEST_CASE( "stream to a sink" ) {
+	std::vector<std::string> pieces;
+	auto sink = [&](const char * data, std::size_t size) { pieces.push_back(std::string(data, size)); };
+	std::size_t piecesBeforeTitle = 0;
+	auto title = [&]() { piecesBeforeTitle = pieces.size(); return "Hello"; };
+	std::string text = "World";
+
+	std::size_t size = TEMPLATE_STREAM(flush, sink);
+	REQUIRE( pieces.size() == 3 );
+	CHECK( piecesBeforeTitle == 1 );
+	CHECK( pieces[0] == "<html><head><link rel=\"stylesheet\" href=\"style.css\"></head>\n<body><h1>" );
+	CHECK( pieces[1] == "Hello</h1>\n" );
+	CHECK( pieces[2] == "<p>World</p></body></html>\n" );
+	CHECK( size == pieces[0].size() + pieces[1].size() + pieces[2].size() );
+
+	std::string res = TEMPLATE(flush);
+	CHECK( res == pieces[0] + pieces[1] + pieces[2] );
+}
+
+#define STRINGIFY(...) #__VA_ARGS__
+#define EXPANDED(...) STRINGIFY(__VA_ARGS__)
+
+TEST_CASE( "constant folding" ) {
+	std::string res = TEMPLATE(constants);
+	CHECK( res == "<p title=\"a &#34;quoted&#34; title\">&lt;b&gt; 42 -7 &amp; 1</p>\n"
+	              "<a href=\"/?q=a%20b%26c\" onclick=\"f('it\\u0027s')\"><i></a>\n" );
+	// One static chunk and nothing formatted at runtime
+	std::string code = EXPANDED(__SERENITY_TEMPLATER_TEMPLATE_constants);
+	CHECK( code.find("writeEscaped") == std::string::npos );
+	CHECK( code.find("writeStatic") == code.rfind("writeStatic") );
+
+	allocations = 0;
+	countAllocations = true;
+	serenity::templater::StaticView view = TEMPLATE_VIEW(constants);
+	countAllocations = false;
+	CHECK( allocations == 0 );
+	CHECK( view.str() == res );
+	CHECK( view.data == TEMPLATE_VIEW(constants).data );
+	CHECK( TEMPLATE_VIEW(static).str() == TEMPLATE(static) );
+	// Identical text is stored once per output file
+	CHECK( TEMPLATE_VIEW(static_copy).data == TEMPLATE_VIEW(static).data );
+
+	res = TEMPLATE(json_constants);
+	CHECK( res == "{\"version\": \"1.2\", \"build\": 1234, \"debug\": false, \"label\": \"v1\\\"2\"}\n" );
+
+	// Numbers and bool after a manipulator are left to operator<<, strings don't depend on the stream's state
+	res = TEMPLATE(constants_state);
+	CHECK( res == "<p>7    42 true s</p>\n" );
+	code = EXPANDED(__SERENITY_TEMPLATER_TEMPLATE_constants_state);
+	CHECK( code.find("(7)") == std::string::npos );
+	CHECK( code.find("(42)") != std::string::npos );
+	CHECK( code.find("(true)") != std::string::npos );
+	CHECK( code.find("\"s\"") == std::string::npos );
+}
+
+TEST_CASE( "dead branches" ) {
+	std::string name = "<x>";
+	std::string res = TEMPLATE(dead_branches);
+	CHECK( res == "<p>&lt;x&gt;!</p>\n" );
+	std::string code = EXPANDED(__SERENITY_TEMPLATER_TEMPLATE_dead_branches);
+	CHECK( code.find("if(") == std::string::npos );
+	// Static text outside the loops and conditions, known before the first render
+	CHECK( serenity::templater::outputSizeEstimates()["dead_branches"] >= std::string("<p>!</p>\n").size() );
+}
+
+TEST_CASE( "reserve before loops" ) {
+	std::vector<std::pair<std::string, int>> rows;
+	std::string correctAnswer = "<table>\n";
+	for (int i = 0; i < 10000; i++) {
+		rows.push_back(std::make_pair("row", i % 10));
+		correctAnswer += "<tr><td>row</td><td>" + std::to_string(i % 10) + "</td></tr>\n";
+	}
+	correctAnswer += "</table>\n";
+
+	// First render, without an estimate: the static text is reserved up front and before the loop,
+	// only the numbers can outgrow it
+	std::string res;
+	allocations = 0;
+	countAllocations = true;
+	TEMPLATE_INTO(table, res);
+	countAllocations = false;
+	CHECK( res == correctAnswer );
+	CHECK( allocations <= 3 );
+}
+
+TEST_CASE( "foreach over integers" ) {
+	std::vector<int> ints = {0, 9, 10, -1, 99999999, 100000000, -2147483647 - 1, 2147483647};
+	long long longs[] = {-9223372036854775807LL - 1, 9223372036854775807LL, 1234567890123456789LL, -100000000};
+	std::list<unsigned long long> list = {18446744073709551615ULL, 7};
+	std::array<unsigned short, 3> shorts = {{0, 65535, 42}};
+	std::vector<unsigned> big(5000);
+	for (std::size_t i = 0; i < big.size(); i++) big[i] = (unsigned)(i * 2654435761u);
+
+	std::string correctAnswer = "[0][9][10][-1][99999999][100000000][-2147483648][2147483647]\n"
+		"<-9223372036854775808><9223372036854775807><1234567890123456789><-100000000>\n"
+		"[18446744073709551615][7]\n"
+		"0,65535,42,\n";
+	for (unsigned n : big) correctAnswer += "<td>" + std::to_string(n) + "</td>";
+	correctAnswer += "\n";
+	// The stream's formatting state applies as it would to each $n
+	correctAnswer += "0,ffff,2a,\n";
+	correctAnswer += "<li>2</li><li>3</li><li>4</li>\n";
+	correctAnswer += "<li>1</li><li>2</li><li>3</li>\n";
+	correctAnswer += "45\n";
+
+	std::string res = TEMPLATE(each);
+	CHECK( res == correctAnswer );
+}
+
+TEST_CASE( "batch" ) {
+	struct Recipient { std::string name; double balance; };
+	std::vector<Recipient> recipients = {{"Ann", 12.5}, {"<Bob>", -3}, {"Cy", 0.125}};
+
+	serenity::templater::Batch batch = TEMPLATE_BATCH(batch, recipient, recipients);
+	REQUIRE( batch.size() == recipients.size() );
+	std::size_t offset = 0;
+	for (std::size_t i = 0; i < recipients.size(); i++) {
+		const Recipient & recipient = recipients[i];
+		std::string res = TEMPLATE(batch);
+		CHECK( batch.spans[i].offset == offset );
+		CHECK( batch.str(i) == res );
+		offset += res.size();
+	}
+	CHECK( batch.data.size() == offset );
+	CHECK( batch.str(1) == "<p>Dear &lt;Bob&gt;,</p>\n<p>your balance is -3.00.</p>\n" );
+}
+
+TEST_CASE( "await" ) {
+	std::string title = "Shop";
+	std::promise<std::vector<std::string>> promise;
+	std::future<std::vector<std::string>> recommended = promise.get_future();
+	// Resolved only after rendering went past the $await block
+	auto footer = [&]() {
+		promise.set_value({"<b>", "a"});
+		return "bye";
+	};
+
+	std::string res = TEMPLATE(await);
+	CHECK( res == "<h1>Shop</h1>\n<ul><li>&lt;b&gt;</li><li>a</li></ul>\n<p>bye</p>\n" );
+}
+
+TEST_CASE( "await with a sink" ) {
+	std::string title = "Shop";
+	std::promise<std::vector<std::string>> promise;
+	std::future<std::vector<std::string>> recommended = promise.get_future();
+	auto footer = [&]() {
+		promise.set_value({"a"});
+		return "bye";
+	};
+	std::promise<std::string> laterPromise;
+	std::future<std::string> later = laterPromise.get_future();
+	auto resolveLater = [&]() {
+		laterPromise.set_value("more");
+		return "";
+	};
+	std::string padding(20000, '.');
+
+	std::string output;
+	auto sink = [&](const char * data, std::size_t size) { output.append(data, size); };
+	std::string afterFlush, afterPadding;
+	auto sent = [&](std::string & into) {
+		into = output;
+		return "";
+	};
+
+	TEMPLATE_STREAM(await_flush, sink);
+	// $flush writes out the sections that are ready and flushes the sink
+	CHECK( afterFlush == "<h1>Shop</h1>\n<ul><li>a</li></ul>\n<p>bye</p>\n" );
+	// So does writing enough after a pending section
+	CHECK( afterPadding == afterFlush + "<p>more</p>\n" + padding );
+	CHECK( output == afterPadding + "<p>end</p>\n" );
+}
+
+TEST_CASE( "render into an arena" ) {
+	std::string title = "Hello!";
+	serenity::templater::Arena arena(64);
+	serenity::templater::ArenaString res = TEMPLATE_IN_ARENA(one_var, arena);
+	CHECK( res == correctAnswer );
+
+	arena.reset();
+	allocations = 0;
+	countAllocations = true;
+	res = TEMPLATE_IN_ARENA(one_var, arena);
+	countAllocations = false;
+	CHECK( allocations == 0 );
+	CHECK( res == correctAnswer );
+
+	// Sizes that don't fit any block, up to ones whose arithmetic would wrap around
+	void * big = arena.allocate(1000, 64);
+	CHECK( (reinterpret_cast<std::uintptr_t>(big) % 64) == 0 );
+	CHECK_THROWS_AS( arena.allocate(std::size_t(-1) - 8), const std::bad_alloc & );
+	CHECK_THROWS_AS( serenity::templater::ArenaAllocator<int>(arena).allocate(std::size_t(-1) / 2), const std::bad_alloc & );
+}
+
 TEST_CASE( "preprocess simple string variable" ) {
 	std::string title = "Hello!";
 	std::string res = TEMPLATE(one_var);
@@ -47,6 +346,13 @@ TEST_CASE( "preprocess two string variables without space between them" ) {
 	CHECK( res == correctAnswer );
 }
 
+TEST_CASE( "preprocess expression spanning several lines" ) {
+	std::string titlePartOne = "Hell";
+	std::string titlePartTwo = "o!";
+	std::string res = TEMPLATE(multiline_expression);
+	CHECK( res == correctAnswer );
+}
+
 TEST_CASE( "preprocess char as int variable" ) {
 	char number1 = 1;
 	std::string res = TEMPLATE(char_as_int_var);
@@ -72,6 +378,98 @@ TEST_CASE( "preprocess std::array and std::vector" ) {
 	CHECK( res == correctAnswer );
 }
 
+TEST_CASE( "preprocess format specifiers" ) {
+	double price = 1234.5678;
+	int count = 42;
+	float ratio = 0.125f;
+	long long negative = -17;
+	double big = 1e20;
+	double zero = 0;
+	std::string res = TEMPLATE(format_specs);
+	CHECK( res ==
+		"<p>1234.57 00000042 12.500000% 12.5% 2a 2A    -17 -00017   2</p>\n"
+		"<p>1 1235 -1234.568 100000000000000000000.00 0.000000</p>\n" );
+}
+
+TEST_CASE( "escape interpolated strings for their context" ) {
+	std::string text = "Tom & \"Jerry\" <3 'cheese' and a line long enough for a couple of SIMD blocks\n";
+	const char * url = "/search?q=a b&lang=\"en\"";
+	std::string script = " Java\tScript:alert(1)";
+	int number = 1 << 20;
+	const char markup[] = "<b>bold</b>";
+	std::string literal = "`;alert(1);//${x} and a line long enough for a couple of SIMD blocks";
+	unsigned char less = '<';
+	signed char quote = '"';
+	const unsigned char * bytes = (const unsigned char *)"<b>";
+	std::string res = TEMPLATE(escaping);
+	const std::string html = "Tom &amp; &#34;Jerry&#34; &lt;3 &#39;cheese&#39; and a line long enough for a couple of SIMD blocks\n";
+	const std::string js = "Tom \\u0026 \\u0022Jerry\\u0022 \\u003C3 \\u0027cheese\\u0027 and a line long enough for a couple of SIMD blocks\\u000A";
+	const std::string textHtml = "Tom &amp; \"Jerry\" &lt;3 'cheese' and a line long enough for a couple of SIMD blocks\n";
+	const std::string unquoted = "Tom&#x20;&amp;&#x20;&#34;Jerry&#34;&#x20;&lt;3&#x20;&#39;cheese&#39;&#x20;and&#x20;a&#x20;line&#x20;long&#x20;enough&#x20;"
+	                             "for&#x20;a&#x20;couple&#x20;of&#x20;SIMD&#x20;blocks&#x0A;";
+	const std::string css = "Tom\\20 \\26 \\20 \\22 Jerry\\22 \\20 \\3C 3\\20 \\27 cheese\\27 \\20 and\\20 a\\20 line\\20 long\\20 enough\\20 "
+	                        "for\\20 a\\20 couple\\20 of\\20 SIMD\\20 blocks\\0A ";
+	const std::string component = "Tom%20%26%20%22Jerry%22%20%3C3%20%27cheese%27%20and%20a%20line%20long%20enough%20for%20a%20couple%20of%20SIMD%20blocks%0A";
+	CHECK( res ==
+		"<p title=\"" + html + "\">" + textHtml + " 1048576 1048576 <b>bold</b></p>\n"
+		"<a href=\"/search?q=a%20b&amp;lang=%22en%22\" onclick='go(\"" + js + "\")'>/search?q=a b&amp;lang=\"en\"</a><!-- " + textHtml + " -->\n"
+		"<script>var s = \"" + js + "\", t = '</script>'; " + textHtml + "</script><style>p { content: \"" + css + "\"; }</style>\n"
+		"<p class=" + unquoted + " style=\"color: " + css + "\" " + unquoted + "><b>bold</b></p><script>var n = 1048576;</script>\n"
+		"<a href=\"about:invalid\">" + textHtml + "</a><a href=/?q=" + component + "> Java\tScript:alert(1)</a>\n"
+		"<script>var u = `hello \\u0060;alert(1);//\\u0024\\u007Bx} and a line long enough for a couple of SIMD blocks`;</script>\n"
+		"<script>// don't cache\n"
+		"var id = \"" + js + "\"; /* \"it's\" */ var r = /[\"'/]/g, q = 1 / 1048576, u = `${ \"" + js + "\" }`;</script>\n"
+		"<a onclick=\"show(&quot;" + js + "&quot;)\" onmouseover=\"f(&quot;" + js + "&quot;)\" onfocus='g(\"1048576\")'>\n"
+		"<p title=\"&#34;\">&lt; &lt;b&gt;</p><svg><a xlink:href=\"about:invalid\"></a></svg><object data=\"about:invalid\"></object>"
+		"<a href=\"/\" ping=\"about:invalid\">\n" );
+}
+
+TEST_CASE( "preprocess json" ) {
+	std::string title = "He said \"hi\"\n\t\x01 \\o/ in a string long enough for SIMD blocks";
+	const char * author = "Bob \"B\"";
+	long long count = -9000000000LL;
+	double ratio = 0.1;
+	bool ok = true;
+	double missing = std::numeric_limits<double>::quiet_NaN();
+	std::vector<std::pair<std::string, float>> items = {{ { "a", 1.5f }, { "b", 0.1f } }};
+	std::vector<int> empty;
+	std::string res = TEMPLATE(json);
+	CHECK( res ==
+		"{\"title\": \"He said \\\"hi\\\"\\n\\t\\u0001 \\\\o/ in a string long enough for SIMD blocks\", \"note\": \"by Bob \\\"B\\\"\", "
+		"\"count\": -9000000000, \"ratio\": 0.1, \"ok\": true, \"missing\": null,\n"
+		"\"items\": [\n  {\"name\": \"a\", \"price\": 1.5},\n  {\"name\": \"b\", \"price\": 0.10000000149011612}\n], \"empty\": []}\n" );
+}
+
+TEST_CASE( "commas between json loop iterations" ) {
+	std::vector<int> numbers = {{ 1, 2, 3, 4, 5 }};
+	std::vector<std::vector<int>> rows = {{ { 1, 2 }, {}, { 3 } }};
+	// Only between iterations that write something, and not inside strings
+	std::string res = TEMPLATE(json_separators);
+	CHECK( res == "{\"odd\": [1,3,5], \"digits\": \"12345\", \"rows\": [1,2,3]}\n" );
+}
+
+TEST_CASE( "json numbers read back as the same double" ) {
+	auto json = [](double value) {
+		std::ostringstream out;
+		serenity::templater::escaping::writeJsonNumber(out, value);
+		return out.str();
+	};
+	CHECK( json(0) == "0" );
+	CHECK( json(-0.0) == "-0" );
+	CHECK( json(100) == "100" );
+	CHECK( json(-2.5) == "-2.5" );
+	CHECK( json(0.3) == "0.3" );
+	CHECK( json(0.0001) == "0.0001" );
+	CHECK( json(0.00001) == "1e-05" );
+	CHECK( json(1e14) == "100000000000000" );
+	CHECK( json(1e15) == "1e+15" );
+	CHECK( json(1e21) == "1e+21" );
+	CHECK( json(4.35) == "4.35" );
+	CHECK( json(5e-324) == "5e-324" );
+	CHECK( json(1.7976931348623157e308) == "1.7976931348623157e+308" );
+	CHECK( json(std::numeric_limits<double>::infinity()) == "null" );
+}
+
 TEST_CASE( "preprocess formatted floats" ) {
 	std::array<unsigned short, 3> ints = {{ 1, 2, 3 }};
 	std::vector<double> floats = {{ 1.1254444, 2.5673333, 3.8742222 }};
@@ -79,4 +477,81 @@ TEST_CASE( "preprocess formatted floats" ) {
 	CHECK( res == correctAnswer );
 }
 
+TEST_CASE( "profile blocks and interpolations" ) {
+	std::array<unsigned short, 3> ints = {{ 1, 2, 3 }};
+	std::vector<double> floats = {{ 1.125, 2.567, 3.874 }};
+	serenity::templater::profiling::reset();
+	std::string res = TEMPLATE(profiled_array_vector);
+	CHECK( res == correctAnswer );
+
+	std::stringstream report;
+	serenity::templater::profiling::report(report);
+	CHECK( report.str().find("\t1\t33\tprofiled_array_vector:7 $foreach(number : ints)\n") != std::string::npos );
+	CHECK( report.str().find("\t3\t3\tprofiled_array_vector:7 $number\n") != std::string::npos );
+	CHECK( report.str().find("\t3\t15\tprofiled_array_vector:11 $number\n") != std::string::npos );
+}
+
+TEST_CASE( "count branches and loop iterations" ) {
+	std::string user;
+	std::vector<int> items = {{ 1, 2 }};
+	std::string res = TEMPLATE(instrumented_branches);
+	CHECK( res == "<html>\n<p>Please log in</p>\n<ul>\n<li>1</li>\n<li>2</li>\n</ul>\n</html>\n" );
+	user = "Bob";
+	items.clear();
+	res = TEMPLATE(instrumented_branches);
+	CHECK( res == "<html>\n<p>Hello, Bob</p>\n<ul>\n</ul>\n</html>\n" );
+
+	std::stringstream profile;
+	serenity::templater::pgo::writeProfile(profile);
+	CHECK( profile.str().find("instrumented_branches\t2\t2\t1\t$if(user.empty())\n") != std::string::npos );
+	CHECK( profile.str().find("instrumented_branches\t5\t2\t2\t$foreach(item : items)\n") != std::string::npos );
+}
+
+TEST_CASE( "lay out branches from profile" ) {
+	std::string user;
+	std::vector<int> items = {{ 1, 2 }};
+	std::string res = TEMPLATE(pgo_branches);
+	CHECK( res == "<html>\n<p>Please log in</p>\n<ul>\n<li>1</li>\n<li>2</li>\n</ul>\n</html>\n" );
+	user = "Bob";
+	items.clear();
+	res = TEMPLATE(pgo_branches);
+	CHECK( res == "<html>\n<p>Hello, Bob</p>\n<ul>\n</ul>\n</html>\n" );
+	// The profile says $if(user.empty()) is rarely true: hinted, and its body moved to a cold function
+	std::string code = EXPANDED(__SERENITY_TEMPLATER_TEMPLATE_pgo_branches);
+	CHECK( code.find("__builtin_expect(!!(user.empty()),0)") != std::string::npos );
+	CHECK( code.find("__attribute__((cold,noinline))") != std::string::npos );
+}
+
+TEST_CASE( "minify static text" ) {
+	std::string name = "Bob";
+	std::vector<int> numbers = {{ 1, 2 }};
+	std::string res = TEMPLATE(minified_page);
+	CHECK( res ==
+		"<!DOCTYPE html><html><body class=\"page\"\nid=\"main\"><h1>Hello, Bob !</h1><p><b>bold</b>\n<i>italic</i></p><ul>\n <li>1</li>\n <li>2</li>\n </ul><pre>\n  keep   this\n    </pre>"
+		"<textarea>  and   this  </textarea><script>\n      var s = \"a   b\";\n    </script><!--[if IE]><p>IE</p><![endif]--></body></html>\n" );
+	res = TEMPLATE(minified_json);
+	CHECK( res == "{\"name\":\"Bob  with spaces\",\"numbers\":[1,2]}" );
+}
+
+TEST_CASE( "table backend" ) {
+	std::string name = "<Bob>";
+	std::vector<int> numbers = {{ 1, 2 }};
+	double price = 4.5;
+	std::string res = TEMPLATE(tabled_page);
+	CHECK( res == "<html>\n<h1>&lt;Bob&gt;</h1>\n<ul>\n<li>1</li>\n<li>2</li>\n</ul>\n<p>4.50 &amp; <br></p>\n<b>20</b>\n</html>\n" );
+	std::string code = EXPANDED(__SERENITY_TEMPLATER_TEMPLATE_tabled_page);
+	CHECK( code.find("serenity::templater::run(") != std::string::npos );
+
+	numbers.clear();
+	res = TEMPLATE(tabled_page);
+	CHECK( res == "<html>\n<h1>&lt;Bob&gt;</h1>\n<p>No numbers</p>\n<p>4.50 &amp; <br></p>\n\n</html>\n" );
+}
+
+TEST_CASE( "static text with .incbin" ) {
+	std::string title = "<Hello>";
+	std::string res = TEMPLATE(incbin_page);
+	CHECK( res == "<html>\n<head><title>&lt;Hello&gt;</title></head>\n<body>\n<p>Static text from an assembler blob</p>\n</body>\n</html>\n" );
+	CHECK( TEMPLATE_VIEW(incbin_static).str() == "<p>Not found</p>\n" );
+}
+
 }
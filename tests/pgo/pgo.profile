@@ -0,0 +1,2 @@
+pgo_branches	2	1000	3	$if(user.empty())
+pgo_branches	5	1000	10	$foreach(item : items)